@@ -0,0 +1,459 @@
+/*
+Headless benchmarks of the equation and mesh code, no window or GL context is opened
+Graph's background job path doesn't call GL, GLEW is linked for the rest of Graph.cpp but never initialized, and no
+ImGui context is made either. Build it next to the editor's sources, e.g. with g++:
+
+	g++ -O2 -std=c++17 -I../ProjectA -I<glew, glfw and imgui includes> benchmark.cpp ../ProjectA/Graph.cpp
+		../ProjectA/parsing.cpp ../ProjectA/simplify.cpp ../ProjectA/bytecode.cpp ../ProjectA/simd.cpp ../ProjectA/jit.cpp
+		../ProjectA/interval.cpp ../ProjectA/threadpool.cpp ../ProjectA/streambuffer.cpp ../ProjectA/gpuequation.cpp
+		../ProjectA/quadtree.cpp ../ProjectA/profiler.cpp ../ProjectA/meshexport.cpp <imgui sources> -lGLEW -lGL -ldl -lpthread -o benchmark
+
+Usage: benchmark [--threads n] [--min-time seconds] [output.json]
+Writes one JSON object of results, to stdout without an output file. "generate" runs on pools of 1, 2, 4... up to n
+threads, the other benchmarks on the calling thread. Every result holds the items processed a second
+("unit" tells what they are) and the heap allocations an iteration makes, so runs of different versions can be diffed
+evaluate_derivatives also records the largest relative difference of its derivatives to evaluate_central_difference's
+evaluate_native only runs where the native backend finds a system C compiler, like the editor's "jit on"
+Exits with 1 before benchmarking if the interval bounds of x^2+z^2 are wrong
+*/
+#include "Graph.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Counted by the global operator new below, on every thread
+static std::atomic<size_t> allocations{ 0 };
+static std::atomic<size_t> allocatedBytes{ 0 };
+
+// GCC pairs the malloc inside operator new with the free inside operator delete wrongly once both are replaced and
+// inlined, -Wmismatched-new-delete is a false positive for replaced global operators
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+	if (void* memory = std::malloc(size ? size : 1)) return memory;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+	std::free(memory);
+}
+
+#pragma GCC diagnostic pop
+
+struct BenchmarkResult
+{
+	string name;
+	string equation;
+	size_t size; // Grid side in samples, 0 if the benchmark has none
+	size_t threads; // Of the pool the benchmark ran on, 1 if it runs on the calling thread alone
+	const char* unit;
+	size_t iterations;
+	double seconds;
+	double items;
+	double allocations; // Per iteration
+	double allocatedBytes;
+	double maxError; // Largest relative difference to the benchmark's reference, negative if it has none
+};
+
+// Equations of the corpus, from trivial to deep. Only characters that need no escaping in JSON
+static const char* corpus[] = {
+	"x+z",
+	"x^2/10-z^2/10",
+	"sin(x)*cos(z)",
+	"log(1+x^2+z^2)",
+	"sin(x*z)/(1+x^2)+cos(z/2)*log(1+z^2)",
+	"atan(x/z)*tan(x/10)+acos(sin(z))-asin(cos(x))",
+	"(x^3-3*x*z^2)/(1+x^2+z^2)^2+sin(x+z)*sin(x-z)*cos(x*z/4)+log(2+sin(x)*cos(z))"
+};
+
+// Sides of the grids equations are evaluated over
+static const size_t evaluation_sizes[] = { 64, 256 };
+// Sides of the sample grid a graph is generated with, sampleCount * resolution * graph_sides for GraphManager
+static const size_t mesh_sizes[] = { 120, 240, 480 };
+// The editor's starting view: 40 units back, a 90 degree field of view in an 800 pixel high window
+static const LodCamera start_camera = { 0, 0, 40, 400 };
+
+// Offset along every variable of the central differences evaluate_derivatives is checked against
+constexpr static double derivative_step = 1e-5;
+// Times the corpus is repeated in the equation parse_long parses
+constexpr static size_t parse_repeats = 16;
+
+static double minSeconds = 0.25;
+constexpr static size_t min_iterations = 3;
+static volatile double sink; // Keeps the compiler from dropping unused results
+
+static vector<BenchmarkResult> results;
+
+/*
+Runs "iteration" once to warm up, then until both minSeconds and min_iterations are reached
+"iteration" returns the items it processed
+*/
+static void run(const char* name, const string& equation, size_t size, const char* unit, const std::function<size_t()>& iteration,
+	size_t threads = 1)
+{
+	iteration();
+
+	BenchmarkResult result = { name, equation, size, threads, unit, 0, 0, 0, 0, 0, -1 };
+	size_t startAllocations = allocations.load(), startBytes = allocatedBytes.load();
+	auto start = std::chrono::steady_clock::now();
+	do
+	{
+		result.items += iteration();
+		result.iterations++;
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (result.seconds < minSeconds || result.iterations < min_iterations);
+	result.allocations = (double)(allocations.load() - startAllocations) / result.iterations;
+	result.allocatedBytes = (double)(allocatedBytes.load() - startBytes) / result.iterations;
+
+	fprintf(stderr, "%-27s %5zu %3zu  %12.0f %s/s  %s\n", name, size, threads, result.items / result.seconds, unit, equation.c_str());
+	results.push_back(result);
+}
+
+/*
+Variable arrays over a size x size grid spanning [-10, 10] along x and z
+*/
+static void fillGrid(const EquationProgram& program, size_t size, vector<vector<double>>& values)
+{
+	values.assign(program.VariableCount(), vector<double>(size * size, 0));
+	int xIndex = program.VariableIndex('x'), zIndex = program.VariableIndex('z');
+	for (size_t r = 0; r < size; r++)
+	{
+		for (size_t c = 0; c < size; c++)
+		{
+			if (xIndex >= 0) values[xIndex][r * size + c] = -10 + 20.0 * c / (size - 1);
+			if (zIndex >= 0) values[zIndex][r * size + c] = -10 + 20.0 * r / (size - 1);
+		}
+	}
+}
+
+static void benchmarkEquation(const string& equation, const vector<char>& varNames, const vector<unique_ptr<ThreadPool>>& threadPools)
+{
+	run("parse", equation, 0, "equations", [&]()
+	{
+		EquationTree tree = GenerateEquationTree(equation, varNames);
+		sink = (double)tree.ArenaSize();
+		return 1;
+	});
+
+	EquationTree tree = GenerateEquationTree(equation, varNames);
+	run("compile", equation, 0, "equations", [&]()
+	{
+		EquationProgram program = CompileEquation(SimplifyEquationTree(tree), varNames);
+		sink = (double)program.InstructionCount();
+		return 1;
+	});
+
+	EquationTree simplified = SimplifyEquationTree(tree);
+	EquationProgram program = CompileEquation(simplified, varNames);
+	EquationProgram unsimplified = CompileEquation(tree, varNames);
+	// The same program as native code, when a system C compiler builds it
+	EquationProgram native = program;
+	if (!native.CompileNative()) fprintf(stderr, "No native code for %s, skipping evaluate_native\n", equation.c_str());
+	for (size_t size : evaluation_sizes)
+	{
+		vector<vector<double>> values;
+		fillGrid(program, size, values);
+		vector<const double*> columns;
+		for (vector<double>& column : values) columns.push_back(column.data());
+		vector<double> vars(program.VariableCount()), out(size * size);
+		EvaluationFrame frame;
+
+		// Walking the tree the program is compiled from, sample by sample like "evaluate"
+		run("evaluate_tree", equation, size, "samples", [&]()
+		{
+			double sum = 0;
+			for (size_t s = 0; s < size * size; s++)
+			{
+				for (size_t v = 0; v < vars.size(); v++) vars[v] = values[v][s];
+				sum += simplified.Evaluate(vars.data());
+			}
+			sink = sum;
+			return size * size;
+		});
+
+		run("evaluate", equation, size, "samples", [&]()
+		{
+			double sum = 0;
+			for (size_t s = 0; s < size * size; s++)
+			{
+				for (size_t v = 0; v < vars.size(); v++) vars[v] = values[v][s];
+				sum += program.Evaluate(vars.data(), frame);
+			}
+			sink = sum;
+			return size * size;
+		});
+
+		// The program compiled without the simplification pass
+		run("evaluate_unsimplified", equation, size, "samples", [&]()
+		{
+			double sum = 0;
+			for (size_t s = 0; s < size * size; s++)
+			{
+				for (size_t v = 0; v < vars.size(); v++) vars[v] = values[v][s];
+				sum += unsimplified.Evaluate(vars.data(), frame);
+			}
+			sink = sum;
+			return size * size;
+		});
+
+		run("evaluate_batch", equation, size, "samples", [&]()
+		{
+			program.EvaluateBatch(columns.data(), out.data(), out.size(), frame);
+			sink = out[out.size() / 2];
+			return size * size;
+		});
+
+		if (native.IsNative())
+		{
+			run("evaluate_native", equation, size, "samples", [&]()
+			{
+				native.EvaluateBatch(columns.data(), out.data(), out.size(), frame);
+				sink = out[out.size() / 2];
+				return size * size;
+			});
+		}
+
+		// Values and the derivatives by every variable, in one dual number pass and by central differences around every sample
+		size_t varCount = program.VariableCount();
+		vector<vector<double>> derivatives(varCount, vector<double>(size * size)), differences = derivatives;
+		vector<double*> derivativeRows;
+		for (vector<double>& row : derivatives) derivativeRows.push_back(row.data());
+		run("evaluate_derivatives", equation, size, "samples", [&]()
+		{
+			program.EvaluateDerivativesBatch(columns.data(), out.data(), derivativeRows.data(), out.size(), frame);
+			sink = out[out.size() / 2];
+			return size * size;
+		});
+		size_t derivativesResult = results.size() - 1;
+
+		// Columns with one variable moved by +-derivative_step
+		vector<vector<double>> above(varCount), below(varCount);
+		vector<vector<const double*>> aboveColumns(varCount, columns), belowColumns(varCount, columns);
+		for (size_t k = 0; k < varCount; k++)
+		{
+			for (double value : values[k])
+			{
+				above[k].push_back(value + derivative_step);
+				below[k].push_back(value - derivative_step);
+			}
+			aboveColumns[k][k] = above[k].data();
+			belowColumns[k][k] = below[k].data();
+		}
+		vector<double> outAbove(size * size), outBelow(size * size);
+		run("evaluate_central_difference", equation, size, "samples", [&]()
+		{
+			program.EvaluateBatch(columns.data(), out.data(), out.size(), frame);
+			for (size_t k = 0; k < varCount; k++)
+			{
+				program.EvaluateBatch(aboveColumns[k].data(), outAbove.data(), out.size(), frame);
+				program.EvaluateBatch(belowColumns[k].data(), outBelow.data(), out.size(), frame);
+				for (size_t s = 0; s < out.size(); s++)
+				{
+					differences[k][s] = (outAbove[s] - outBelow[s]) / (2 * derivative_step);
+				}
+			}
+			sink = out[out.size() / 2];
+			return size * size;
+		});
+
+		// Relative to the derivative, or absolute where it is below 1. Samples undefined either way are skipped
+		double maxError = 0;
+		for (size_t k = 0; k < varCount; k++)
+		{
+			for (size_t s = 0; s < size * size; s++)
+			{
+				double exact = derivatives[k][s], difference = differences[k][s];
+				if (!std::isfinite(exact) || !std::isfinite(difference)) continue;
+				maxError = std::max(maxError, std::abs(exact - difference) / std::max(std::abs(exact), 1.0));
+			}
+		}
+		results[derivativesResult].maxError = maxError;
+		fprintf(stderr, "%-27s %5zu      %12.3g max relative error to central differences\n", "evaluate_derivatives", size, maxError);
+	}
+
+	// A new graph every iteration, so every patch is bounded and evaluated and the mesh built from scratch, on every pool
+	for (size_t size : mesh_sizes)
+	{
+		size_t maxPatches = size * size / ((Graph::patch_samples + 1) * (Graph::patch_samples + 1));
+		for (const unique_ptr<ThreadPool>& threadPool : threadPools)
+		{
+			run("generate", equation, size, "vertices", [&]()
+			{
+				Graph graph(1, 0, program);
+				GraphRequest request;
+				request.generate = true;
+				request.camera = start_camera;
+				request.sampleSize = 1;
+				request.maxPatches = maxPatches;
+				graph.Request(request);
+
+				TaskGroup jobs;
+				graph.StartJob(*threadPool, jobs, varNames);
+				threadPool->Wait(jobs);
+				unique_ptr<GraphJobResult> result = graph.TakeJobResult();
+				sink = (double)result->outlineIndicesX.size();
+				return result->slopes.size() / 2;
+			}, threadPool->ThreadCount());
+		}
+	}
+}
+
+/*
+Parser throughput on one long equation, the corpus joined by + parse_repeats times over
+*/
+static void benchmarkParser(const vector<char>& varNames)
+{
+	string equation;
+	for (size_t r = 0; r < parse_repeats; r++)
+	{
+		for (const char* term : corpus)
+		{
+			if (!equation.empty()) equation += "+";
+			equation += string("(") + term + ")";
+		}
+	}
+
+	string label = "corpus x" + std::to_string(parse_repeats);
+	run("parse_long", label, 0, "characters", [&]()
+	{
+		EquationTree tree = GenerateEquationTree(equation, varNames);
+		sink = (double)tree.ArenaSize();
+		return equation.size();
+	});
+}
+
+/*
+Surface indices of every slot GraphManager makes room for, they don't depend on the equation
+*/
+static void benchmarkIndices()
+{
+	const size_t n = Graph::patch_samples + 1;
+	for (size_t size : mesh_sizes)
+	{
+		size_t slots = size * size / (n * n);
+		run("indices", "", size, "indices", [&]()
+		{
+			vector<GLuint> indices;
+			for (size_t slot = 0; slot < slots; slot++)
+			{
+				AppendGridStrips(indices, (GLuint)(slot * n * n), n, Graph::patch_samples, Graph::strip_tile);
+			}
+			sink = (double)indices.back();
+			return indices.size();
+		});
+	}
+}
+
+/*
+Checks the bounds patches are culled and refined by, x^2+z^2 over x, z in [-a, a] has to bound to [0, 2a^2]
+*/
+static bool checkBounds(const vector<char>& varNames)
+{
+	const double a = 4;
+	EquationProgram program = CompileEquation(SimplifyEquationTree(GenerateEquationTree("x^2+z^2", varNames)), varNames);
+	Interval range;
+	range.lo = -a;
+	range.hi = a;
+	vector<Interval> varRanges(program.VariableCount(), range);
+	EvaluationFrame frame;
+	Interval bounds = program.EvaluateInterval(varRanges.data(), frame);
+	if (bounds.lo == 0 && bounds.hi == 2 * a * a && !bounds.maybeUndefined && !bounds.empty) return true;
+	fprintf(stderr, "x^2+z^2 over [%g, %g] bounds to [%g, %g], expected [0, %g]\n", -a, a, bounds.lo, bounds.hi, 2 * a * a);
+	return false;
+}
+
+static void writeResults(FILE* file, size_t threads)
+{
+	fprintf(file, "{\n\"threads\": %zu,\n\"min_time\": %g,\n\"results\": [", threads, minSeconds);
+	for (size_t r = 0; r < results.size(); r++)
+	{
+		const BenchmarkResult& result = results[r];
+		fprintf(file, "%s\n{\"name\": \"%s\", \"equation\": \"%s\", \"size\": %zu, \"threads\": %zu, \"unit\": \"%s\", \"iterations\": %zu, "
+			"\"seconds\": %.6f, \"items_per_second\": %.1f, \"ns_per_item\": %.3f, \"allocations\": %.1f, \"allocated_bytes\": %.1f",
+			r > 0 ? "," : "", result.name.c_str(), result.equation.c_str(), result.size, result.threads, result.unit, result.iterations,
+			result.seconds, result.items / result.seconds, result.seconds * 1e9 / result.items, result.allocations,
+			result.allocatedBytes);
+		if (result.maxError >= 0) fprintf(file, ", \"max_relative_error\": %.3g}", result.maxError);
+		else fprintf(file, "}");
+	}
+	fprintf(file, "\n]\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+	size_t threads = 1;
+	const char* output = nullptr;
+	for (int a = 1; a < argc; a++)
+	{
+		string arg = argv[a];
+		if (arg == "--threads" && a + 1 < argc) threads = std::max(1, atoi(argv[++a]));
+		else if (arg == "--min-time" && a + 1 < argc) minSeconds = atof(argv[++a]);
+		else if (arg[0] != '-') output = argv[a];
+		else
+		{
+			fprintf(stderr, "Usage: benchmark [--threads n] [--min-time seconds] [output.json]\n");
+			return 1;
+		}
+	}
+
+	// Graphs are generated on pools of 1, 2, 4... threads up to "threads", to show how the pool scales
+	vector<unique_ptr<ThreadPool>> threadPools;
+	for (size_t count = 1; count < threads; count *= 2)
+	{
+		threadPools.emplace_back(new ThreadPool(count));
+	}
+	threadPools.emplace_back(new ThreadPool(threads));
+	vector<char> varNames = { 'x', 'z' };
+	if (!checkBounds(varNames)) return 1;
+	for (const char* equation : corpus)
+	{
+		benchmarkEquation(equation, varNames, threadPools);
+	}
+	benchmarkParser(varNames);
+	benchmarkIndices();
+
+	FILE* file = output != nullptr ? fopen(output, "w") : stdout;
+	if (file == nullptr)
+	{
+		fprintf(stderr, "Can't write %s\n", output);
+		return 1;
+	}
+	writeResults(file, threads);
+	return file != stdout && fclose(file) != 0 ? 1 : 0;
+}
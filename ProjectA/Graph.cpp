@@ -1,5 +1,12 @@
 #include "Graph.h"
+#include "jit.h"
+#include "shaders.h"
+#include "profiler.h"
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
 #include "misc/cpp/imgui_stdlib.h"
 
 
@@ -7,165 +14,817 @@
 // ------ Graph Section ------
 //
 
-Graph::Graph(size_t id, GLuint program, double& x, double& z, unique_ptr<EquationNode> graphEquation = nullptr) : id(id), _program(program),
-	_x(x), _z(z)
+Graph::Graph(size_t id, GLuint heightfieldProgram, EquationProgram graphEquation) : id(id),
+	_cancelEpoch(0), _mailbox(nullptr), _quadtree(lod_extent, patch_samples, max_lod_level),
+	_heightfieldProgram(heightfieldProgram)
 {
 	show = true;
-	_bufferHorizontalOutlineZupper = NULL; _bufferHorizontalOutlineXupper = NULL; _bufferGraphSurface = NULL;
-	_bufferHorizontalOutlineZlower = NULL; _bufferHorizontalOutlineXlower = NULL;
+	_hasPending = false; _jobRunning = false;
+	_requestedCamera = {}; _requestedSampleSize = 0; _rebuild = true;
+	_patchSampleSize = 0; _lodUpdates = 0; _meshStale = true;
+	_vertexArray = 0; _attributesStale = true;
+	_patchBuffer = 0; _patchTexture = 0; _quantized = false; _heightScale = 1; _heightBias = 0;
+	_slotCapacity = 0; _outlineBuffer = 0; _outlineIndexType = GL_UNSIGNED_INT; _outlineIndicesZ = 0; _outlineIndicesX = 0;
 	_graphEquation = std::move(graphEquation);
 }
 
+Graph::~Graph()
+{
+	delete _mailbox.load(std::memory_order_acquire);
+	if (_vertexArray != 0) glDeleteVertexArrays(1, &_vertexArray);
+	if (_patchTexture != 0) glDeleteTextures(1, &_patchTexture);
+	if (_patchBuffer != 0) glDeleteBuffers(1, &_patchBuffer);
+	if (_outlineBuffer != 0) glDeleteBuffers(1, &_outlineBuffer);
+}
 
 /*
-Generates and binds the vertices of the graph surface and graph outlines
+Merges the request into the pending one, the later request's equation and camera win
 */
-void Graph::Generate(double sampleSize, size_t sampleCount, size_t resolution)
+void Graph::Request(GraphRequest request)
 {
-	unsigned int estimatedPolys3D = pow(sampleCount * resolution * graph_sides, 2);
-	
-	size_t bufferSize = estimatedPolys3D * sizeof(position);
-	position* buffer1 = (position*)malloc(bufferSize);
-	position* buffer2 = (position*)malloc(bufferSize);
-	
-	position* graphOutlineZupper;
-	position* graphOutlineZlower;
-	position* graphOutlineXupper;
-	position* graphOutlineXlower;
-	position* graphSurface;
+	if (request.generate && !request.edit && !_rebuild && request.sampleSize == _requestedSampleSize &&
+		request.camera.x == _requestedCamera.x && request.camera.y == _requestedCamera.y &&
+		request.camera.z == _requestedCamera.z && request.camera.pixelsPerUnit == _requestedCamera.pixelsPerUnit)
+	{
+		request.generate = false;
+	}
+	if (!request.edit && !request.generate) return;
+
+	// An edit or a zoom makes everything the running job computes stale, a camera move only some of its patches
+	if (_jobRunning && (request.edit || (request.generate && _running.generate && request.sampleSize != _running.sampleSize)))
+	{
+		_cancelEpoch.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	if (request.edit)
+	{
+		_pending.edit = true;
+		_pending.equation = std::move(request.equation);
+		_pending.native = request.native;
+	}
+	if (request.generate)
+	{
+		_pending.generate = true;
+		_pending.rebuild |= request.rebuild || _rebuild;
+		_pending.camera = _requestedCamera = request.camera;
+		_pending.sampleSize = _requestedSampleSize = request.sampleSize;
+		_pending.maxPatches = request.maxPatches;
+		_pending.quantize = request.quantize;
+		_rebuild = false;
+	}
+	_hasPending = true;
+}
+
+void Graph::StartJob(ThreadPool& threadPool, TaskGroup& jobs, const vector<char>& varNames)
+{
+	if (_jobRunning || !_hasPending) return;
+
+	_running = std::move(_pending);
+	_running.graphEquation = _graphEquation;
+	_pending = GraphRequest();
+	_hasPending = false;
+	_jobRunning = true;
+	// Persistently mapped buffers hand the job the regions the next Upload writes, so the mesh is built right into them
+	// and the render thread copies nothing. Nothing else maps them until the job's result is uploaded
+	if (_running.generate && _slotCapacity > 0)
+	{
+		size_t vertices = _slotCapacity * patch_vertices;
+		size_t heightSize = _running.quantize ? sizeof(GLushort) : sizeof(GLfloat);
+		_running.mappedHeights = _bufferGraphHeights.Reserve(vertices * heightSize);
+		_running.mappedSlopes = (GLushort*)_bufferGraphSlopes.Reserve(vertices * 2 * sizeof(GLushort));
+		_running.mappedSlots = _slotCapacity;
+		if (_running.mappedHeights == nullptr) _running.mappedSlopes = nullptr;
+	}
+	size_t epoch = _cancelEpoch.load(std::memory_order_relaxed);
+	threadPool.Submit(jobs, [this, &threadPool, &varNames, epoch]() { runJob(_running, epoch, threadPool, varNames); });
+}
 
-	int index = 0;
-	int range = sampleCount;
-	int smoothRange = sampleCount * resolution;
+/*
+Requests of a cancelled job are queued again under the ones made since, so no edit is lost
+*/
+unique_ptr<GraphJobResult> Graph::TakeJobResult()
+{
+	unique_ptr<GraphJobResult> result(_mailbox.exchange(nullptr, std::memory_order_acquire));
+	if (result == nullptr) return result;
 
-	graphSurface = buffer1;
-	for (int i = -smoothRange; i < smoothRange; i++)
+	_jobRunning = false;
+	if (result->cancelled)
 	{
-		_z = i * sampleSize / resolution;
-		for (int j = -smoothRange; j < smoothRange; j++)
+		if (_running.edit && !_pending.edit)
+		{
+			_pending.edit = true;
+			_pending.equation = std::move(_running.equation);
+			_pending.native = _running.native;
+		}
+		if (_running.generate && !_pending.generate)
 		{
-			_x = j * sampleSize / resolution;
+			_pending.generate = true;
+			_pending.camera = _running.camera;
+			_pending.sampleSize = _running.sampleSize;
+			_pending.maxPatches = _running.maxPatches;
+			_pending.quantize = _running.quantize;
+		}
+		_pending.rebuild |= _running.rebuild;
+		_hasPending = true;
+	}
+	return result;
+}
 
-			graphSurface[index].x = (GLfloat)(_x / sampleSize);
-			graphSurface[index].z = (GLfloat)(_z / sampleSize);
+/*
+Compiles the edited equation, then refines and evaluates the patches and builds the mesh from them, on the pool
+Checks for cancellation between steps and between patches, a cancelled job still posts its result
+*/
+void Graph::runJob(const GraphRequest& request, size_t epoch, ThreadPool& threadPool, const vector<char>& varNames)
+{
+	ProfileScope scope("Graph job", id);
+	GraphJobResult* result = new GraphJobResult;
+	const EquationProgram* equation = &request.graphEquation;
+	if (request.edit)
+	{
+		ProfileScope compileScope("Compile equation", id);
+		result->edited = true;
+		EquationTree tree = ParseEquation(request.equation, varNames, result->diagnostic);
+		if (!tree.Empty() && !cancelled(epoch))
+		{
+			result->valid = true;
+			result->equation = CompileEquation(SimplifyEquationTree(tree), varNames);
+			if (request.native) result->equation.CompileNative();
+			equation = &result->equation;
+		}
+	}
 
-			graphSurface[index].y = _graphEquation->Evaluate();
+	if (request.generate && !cancelled(epoch))
+	{
+		if (equation->Id() != _lodEquation.Id())
+		{
+			_lodEquation = *equation;
+			_patches.clear();
+			_meshStale = true;
+		}
+		{
+			ProfileScope lodScope("Update LOD", id);
+			if (UpdateLod(request.camera, request.sampleSize, request.maxPatches)) _meshStale = true;
+		}
 
-			index++;
+		const vector<PatchId>& leaves = _quadtree.Leaves();
+		vector<pair<const PatchId*, Patch*>> pending;
+		for (const PatchId& leaf : leaves)
+		{
+			Patch& patch = _patches.at(leaf.Key());
+			if (isDrawn(patch) && patch.heights.empty()) pending.push_back({ &leaf, &patch });
+		}
+		threadPool.ParallelFor(pending.size(), 1, [&](size_t begin, size_t end)
+		{
+			ProfileScope evaluateScope("Evaluate patches", id);
+			for (size_t p = begin; p < end && !cancelled(epoch); p++)
+			{
+				evaluatePatch(*pending[p].first, *pending[p].second);
+			}
+		});
+
+		if ((_meshStale || request.rebuild) && !cancelled(epoch))
+		{
+			ProfileScope meshScope("Build mesh", id);
+			buildMesh(*result, threadPool, request);
+			result->generated = true;
 		}
 	}
-	bindVertexBuffer(_bufferGraphSurface, graphSurface, bufferSize);
-	memset(buffer1, 0 , bufferSize);
 
-	const GLfloat zFightningFix = 0.1;
-	graphOutlineZlower = buffer1;
-	graphOutlineZupper = buffer2;
-	index = 0;
-	for (int i = -range; i < range; i++)
+	result->cancelled = cancelled(epoch);
+	if (result->generated && !result->cancelled) _meshStale = false;
+	_mailbox.store(result, std::memory_order_release);
+}
+
+/*
+Bounds of the patch's heights, clamped to the drawn range, returns false if the patch isn't worth refining
+*/
+bool Graph::patchBounds(const PatchId& id, double& lo, double& hi)
+{
+	Patch& patch = _patches[id.Key()];
+	patch.lastUsed = _lodUpdates;
+	if (!patch.boundsKnown)
+	{
+		double x0 = _quadtree.PatchX(id), z0 = _quadtree.PatchZ(id), side = _quadtree.PatchSide(id.level);
+		Interval xRange, zRange;
+		xRange.lo = x0 * _patchSampleSize; xRange.hi = (x0 + side) * _patchSampleSize;
+		zRange.lo = z0 * _patchSampleSize; zRange.hi = (z0 + side) * _patchSampleSize;
+		vector<Interval> varRanges(_lodEquation.VariableCount(), xRange);
+		int zIndex = _lodEquation.VariableIndex('z');
+		if (zIndex >= 0) varRanges[zIndex] = zRange;
+
+		EvaluationFrame frame;
+		patch.bounds = _lodEquation.EvaluateInterval(varRanges.data(), frame);
+		patch.boundsKnown = true;
+	}
+
+	if (!isDrawn(patch))
+	{
+		lo = hi = 0;
+		return false;
+	}
+	lo = std::max(patch.bounds.lo, -view_height);
+	hi = std::min(patch.bounds.hi, view_height);
+	return patch.bounds.maybeUndefined || patch.bounds.Width() > flat_tolerance;
+}
+
+// Patches undefined everywhere, or entirely beyond view_height, are skipped
+bool Graph::isDrawn(const Patch& patch) const
+{
+	return !patch.bounds.empty && patch.bounds.lo <= view_height && patch.bounds.hi >= -view_height;
+}
+
+/*
+Evaluates the (patch_samples + 1)^2 vertices of a patch, the derivatives give the normals
+*/
+void Graph::evaluatePatch(const PatchId& id, Patch& patch) const
+{
+	const size_t n = patch_samples + 1;
+	const double x0 = _quadtree.PatchX(id), z0 = _quadtree.PatchZ(id), spacing = _quadtree.SampleSpacing(id.level);
+	int xIndex = _lodEquation.VariableIndex('x');
+	int zIndex = _lodEquation.VariableIndex('z');
+
+	vector<double> xs(n * n), zs(n * n), ys(n * n);
+	vector<const double*> vars(_lodEquation.VariableCount(), xs.data());
+	if (zIndex >= 0) vars[zIndex] = zs.data();
+	vector<vector<double>> derivatives(_lodEquation.VariableCount(), vector<double>(n * n, 0));
+	vector<double*> derivativePtrs;
+	for (vector<double>& derivative : derivatives) derivativePtrs.push_back(derivative.data());
+
+	patch.heights.resize(n * n);
+	patch.slopes.assign(n * n * 2, 0);
+	for (size_t r = 0; r < n; r++)
 	{
-		_x = i * sampleSize;
-		for (int j = -smoothRange; j < smoothRange; j++)
+		for (size_t c = 0; c < n; c++)
 		{
-			_z = j * sampleSize / resolution;
+			size_t index = r * n + c;
+			xs[index] = (x0 + c * spacing) * _patchSampleSize;
+			zs[index] = (z0 + r * spacing) * _patchSampleSize;
+		}
+	}
 
-			graphOutlineZupper[index].x = (GLfloat)(_x / sampleSize);
-			graphOutlineZupper[index].z = (GLfloat)(_z / sampleSize);
-			graphOutlineZlower[index].x = graphOutlineZupper[index].x;
-			graphOutlineZlower[index].z = graphOutlineZupper[index].z;
+	EvaluationFrame frame;
+	_lodEquation.EvaluateDerivativesBatch(vars.data(), ys.data(), derivativePtrs.data(), n * n, frame);
+	for (size_t index = 0; index < n * n; index++)
+	{
+		patch.heights[index] = ys[index];
 
-			// The outlines can't be placed directly on the graph due to Z fightning.
-			graphOutlineZupper[index].y = _graphEquation->Evaluate() + zFightningFix;
-			graphOutlineZlower[index].y = graphOutlineZupper[index].y - (2 * zFightningFix);
+		// x and z are drawn scaled down by the sample size while y isn't, which scales the slopes up
+		GLfloat normalX = xIndex >= 0 ? (GLfloat)(-derivatives[xIndex][index] * _patchSampleSize) : 0;
+		GLfloat normalZ = zIndex >= 0 ? (GLfloat)(-derivatives[zIndex][index] * _patchSampleSize) : 0;
+		if (std::isfinite(normalX) && std::isfinite(normalZ))
+		{
+			patch.slopes[index * 2] = normalX;
+			patch.slopes[index * 2 + 1] = normalZ;
+		}
+	}
+}
 
-			index++;
+/*
+Refines the patches of the surface for the camera, patches evaluated earlier at the same sample size are kept
+*/
+bool Graph::UpdateLod(const LodCamera& camera, double sampleSize, size_t maxPatches)
+{
+	bool changed = false;
+	if (sampleSize != _patchSampleSize)
+	{
+		_patches.clear();
+		_patchSampleSize = sampleSize;
+		changed = true;
+	}
+	_lodUpdates++;
+	auto bounds = [this](const PatchId& patch, double& lo, double& hi) { return patchBounds(patch, lo, hi); };
+	changed |= _quadtree.Update(camera, lod_pixels, maxPatches, bounds);
+	// Leaves made by balancing the tree weren't bounded yet
+	double lo, hi;
+	for (const PatchId& leaf : _quadtree.Leaves()) patchBounds(leaf, lo, hi);
+
+	// Patches out of use are dropped once there are a few trees' worth of them
+	if (_patches.size() > patch_cache_factor * maxPatches)
+	{
+		for (auto it = _patches.begin(); it != _patches.end();)
+		{
+			if (it->second.lastUsed != _lodUpdates) it = _patches.erase(it);
+			else ++it;
 		}
 	}
-	bindVertexBuffer(_bufferHorizontalOutlineZupper, graphOutlineZupper, bufferSize);
-	bindVertexBuffer(_bufferHorizontalOutlineZlower, graphOutlineZlower, bufferSize);
+	return changed;
+}
+
+/*
+Nearest half float, values beyond its range are clamped to it and values too small for a normal half flushed to 0
+*/
+static GLushort toHalf(float value)
+{
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	GLushort sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+	if (exponent <= 0) return sign;
+	if (exponent >= 31) return sign | 0x7bff;
+
+	// Rounding may carry into the exponent, which still gives the right half, unless that makes it infinite
+	uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) half++;
+	return sign | (GLushort)std::min<uint32_t>(half, 0x7bff);
+}
+
+// The vertex buffers keep their capacity for a mesh of "slots" slots, see Graph::Upload
+static bool fitsCapacity(size_t slots, size_t capacity)
+{
+	slots = std::max<size_t>(1, slots);
+	return slots <= capacity && 4 * slots >= capacity;
+}
+
+/*
+Builds the heights and slopes of the drawn leaves' vertices, and the indices drawing them
+Samples on edges shared with a coarser leaf are snapped onto the coarser leaf's edge. The outlines run every drawn
+unit, over the same vertices
+The vertices go straight into the request's mapped regions if the mesh fits them. Those are only ever written, each
+slot is built on the stack and written out in one go
+*/
+void Graph::buildMesh(GraphJobResult& result, ThreadPool& threadPool, const GraphRequest& request) const
+{
+	const bool quantize = request.quantize;
+	const size_t n = patch_samples + 1;
+	const vector<PatchId>& leaves = _quadtree.Leaves();
+
+	vector<size_t> drawn; // Leaves drawn, by slot
+	vector<const Patch*> drawnPatches;
+	for (size_t k = 0; k < leaves.size(); k++)
+	{
+		const Patch& patch = _patches.at(leaves[k].Key());
+		if (!isDrawn(patch)) continue;
+		drawn.push_back(k);
+		drawnPatches.push_back(&patch);
+	}
 
-	graphOutlineXlower = buffer1;
-	graphOutlineXupper = buffer2;
-	index = 0;
-	for (int i = -range; i < range; i++)
+	// Every drawn leaf takes its own slot of vertices and of triangles. Quantized heights are only written out once the
+	// graph's range is known, until then they're kept as floats
+	result.quantized = quantize;
+	if (request.mappedSlopes != nullptr && fitsCapacity(drawn.size(), request.mappedSlots))
+	{
+		result.mappedHeights = request.mappedHeights;
+		result.mappedSlopes = request.mappedSlopes;
+	}
+	if (result.mappedSlopes == nullptr || quantize) result.heights.resize(drawn.size() * n * n);
+	if (result.mappedSlopes == nullptr) result.slopes.resize(drawn.size() * n * n * 2);
+	GLfloat* heightsOut = result.heights.empty() ? (GLfloat*)result.mappedHeights : result.heights.data();
+	GLushort* slopesOut = result.slopes.empty() ? result.mappedSlopes : result.slopes.data();
+	result.patches.resize(drawn.size() * 4);
+	result.heightRanges.resize(drawn.size() * 2);
+	threadPool.ParallelFor(drawn.size(), patches_per_task, [&](size_t begin, size_t end)
 	{
-		_z = i * sampleSize;
-		for (int j = -smoothRange; j < smoothRange; j++)
+		GLfloat heights[n * n];
+		GLfloat slopes[n * n * 2];
+		for (size_t slot = begin; slot < end; slot++)
 		{
-			_x = j * sampleSize / resolution;
+			const Patch& patch = *drawnPatches[slot];
+			const PatchId& id = leaves[drawn[slot]];
+			std::copy(patch.heights.begin(), patch.heights.end(), heights);
+			std::copy(patch.slopes.begin(), patch.slopes.end(), slopes);
+			result.patches[slot * 4] = (GLfloat)_quadtree.PatchX(id);
+			result.patches[slot * 4 + 1] = (GLfloat)_quadtree.PatchZ(id);
+			result.patches[slot * 4 + 2] = (GLfloat)_quadtree.SampleSpacing(id.level);
+			result.patches[slot * 4 + 3] = 0;
+
+			// The coarser leaf's edge is a straight line between every other sample of this one
+			auto snap = [&](size_t a, size_t b, size_t c)
+			{
+				heights[b] = (heights[a] + heights[c]) / 2;
+				slopes[b * 2] = (slopes[a * 2] + slopes[c * 2]) / 2;
+				slopes[b * 2 + 1] = (slopes[a * 2 + 1] + slopes[c * 2 + 1]) / 2;
+			};
+			unsigned int edges = _quadtree.CoarserEdges(drawn[slot]);
+			for (size_t k = 1; k < n; k += 2)
+			{
+				if (edges & EDGE_LOW_X) snap((k - 1) * n, k * n, (k + 1) * n);
+				if (edges & EDGE_HIGH_X) snap(k * n - 1, (k + 1) * n - 1, (k + 2) * n - 1);
+				if (edges & EDGE_LOW_Z) snap(k - 1, k, k + 1);
+				if (edges & EDGE_HIGH_Z) snap((n - 1) * n + k - 1, (n - 1) * n + k, (n - 1) * n + k + 1);
+			}
+			std::copy(heights, heights + n * n, heightsOut + slot * n * n);
+			std::transform(slopes, slopes + n * n * 2, slopesOut + slot * n * n * 2, toHalf);
+
+			// Snapped heights lie between their neighbors', quantized ones within the graph's range
+			GLfloat lo = std::numeric_limits<GLfloat>::infinity(), hi = -lo;
+			for (size_t v = 0; v < n * n; v++)
+			{
+				if (!std::isfinite(heights[v])) continue;
+				lo = std::min(lo, heights[v]);
+				hi = std::max(hi, heights[v]);
+			}
+			result.heightRanges[slot * 2] = lo <= hi ? lo : 0;
+			result.heightRanges[slot * 2 + 1] = lo <= hi ? hi : 0;
+		}
+	});
 
-			graphOutlineXupper[index].x = (GLfloat)(_x / sampleSize);
-			graphOutlineXupper[index].z = (GLfloat)(_z / sampleSize);
-			graphOutlineXlower[index].x = graphOutlineXupper[index].x;
-			graphOutlineXlower[index].z = graphOutlineXupper[index].z;
+	// Quantized heights span the graph's defined heights within the drawn range, those beyond it are clamped to it
+	if (quantize)
+	{
+		GLfloat lo = (GLfloat)view_height, hi = (GLfloat)-view_height;
+		for (GLfloat height : result.heights)
+		{
+			if (!std::isfinite(height)) continue;
+			lo = std::min(lo, height);
+			hi = std::max(hi, height);
+		}
+		lo = std::max(lo, (GLfloat)-view_height);
+		hi = std::min(hi, (GLfloat)view_height);
+		result.heightBias = lo;
+		result.heightScale = hi > lo ? (hi - lo) / 65534 : 1;
+
+		if (result.mappedHeights == nullptr) result.quantizedHeights.resize(result.heights.size());
+		GLushort* quantizedOut = result.quantizedHeights.empty() ? (GLushort*)result.mappedHeights : result.quantizedHeights.data();
+		std::transform(result.heights.begin(), result.heights.end(), quantizedOut, [&](GLfloat height)
+		{
+			if (!std::isfinite(height)) return (GLushort)65535;
+			return (GLushort)std::lround(std::clamp((height - lo) / result.heightScale, 0.0f, 65534.0f));
+		});
+		result.heights.clear();
+	}
 
-			graphOutlineXupper[index].y = _graphEquation->Evaluate() + zFightningFix;
-			graphOutlineXlower[index].y = graphOutlineXupper[index].y - (2 * zFightningFix);
+	// Lines run along every sample row/column that falls on a whole drawn unit, or every one in coarser patches, as a
+	// line strip across the patch. Each patch draws the lines on its low edges, the neighbor draws the ones on its high edges
+	// Slots stay below max_patches, so their vertices fit 32 bit indices
+	result.outlineStartsZ.resize(drawn.size());
+	result.outlineStartsX.resize(drawn.size());
+	for (size_t slot = 0; slot < drawn.size(); slot++)
+	{
+		const PatchId& id = leaves[drawn[slot]];
+		size_t stride = std::max<size_t>(1, (size_t)std::lround(1 / _quadtree.SampleSpacing(id.level)));
+		size_t last = (id.j + 1 == 1u << id.level) ? n : n - 1;
+		GLuint base = (GLuint)(slot * n * n);
+		result.outlineStartsZ[slot] = result.outlineIndicesZ.size();
+		result.outlineStartsX[slot] = result.outlineIndicesX.size();
+		for (size_t c = 0; c < last; c++)
+		{
+			if ((id.j * patch_samples + c) % stride != 0) continue;
+			for (size_t r = 0; r < n; r++)
+			{
+				result.outlineIndicesZ.push_back(base + r * n + c);
+			}
+			result.outlineIndicesZ.push_back(restart_index);
+		}
+		last = (id.i + 1 == 1u << id.level) ? n : n - 1;
+		for (size_t r = 0; r < last; r++)
+		{
+			if ((id.i * patch_samples + r) % stride != 0) continue;
+			for (size_t c = 0; c < n; c++)
+			{
+				result.outlineIndicesX.push_back(base + r * n + c);
+			}
+			result.outlineIndicesX.push_back(restart_index);
+		}
+	}
+}
 
-			index++;
+/*
+Appends triangle strips over the "quads" x "quads" quads of a square of vertices, "stride" vertices a row, starting at
+"base". The strips run along the rows of columns "tile" quads wide, so the vertices of a strip's first row are still in
+the post-transform cache when the next strip reuses them. Each strip ends with restart_index
+*/
+void AppendGridStrips(vector<GLuint>& indices, GLuint base, size_t stride, size_t quads, size_t tile)
+{
+	for (size_t column = 0; column < quads; column += tile)
+	{
+		size_t last = std::min(quads, column + tile);
+		for (size_t r = 0; r < quads; r++)
+		{
+			for (size_t c = column; c <= last; c++)
+			{
+				indices.push_back(base + r * stride + c);
+				indices.push_back(base + (r + 1) * stride + c);
+			}
+			indices.push_back(Graph::restart_index);
 		}
 	}
-	bindVertexBuffer(_bufferHorizontalOutlineXupper, graphOutlineXupper, bufferSize);
-	bindVertexBuffer(_bufferHorizontalOutlineXlower, graphOutlineXlower, bufferSize);
-	
-	free(buffer1);
-	free(buffer2);
 }
 
 /*
-Draws the graph surface and outlines
+Fills the element buffer bound to the current vertex array with "indices", as 16 bit indices if "vertices" fit in them
+besides their restart index. Returns the type of the indices
 */
-void Graph::Draw(GLuint sampleCount, GLuint resolution, GLuint* indexBuffer, GraphProperties properties)
+static GLenum fillElementBuffer(const vector<GLuint>& indices, size_t vertices, GLenum usage)
 {
-	GLuint uniform_color = glGetUniformLocation(_program, "color");
-	size_t const vertexCount = sampleCount * resolution * graph_sides;
-	size_t const vertexDimensions = 3;
+	if (vertices >= 0xffff)
+	{
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), usage);
+		return GL_UNSIGNED_INT;
+	}
 
-	// Enable color grading for the graph
-	GLuint uniform_isGradient = glGetUniformLocation(_program, "isGradient");
-	glUniform1i(uniform_isGradient, true);
+	vector<GLushort> shortIndices(indices.begin(), indices.end());
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(GLushort), shortIndices.data(), usage);
+	return GL_UNSIGNED_SHORT;
+}
 
-	size_t triangleVertexCount = (pow(vertexCount + duplicate_rowindecies, graph_sides) * index_repeats) - non_repeating_index_rows * vertexCount;
-	glUniform4f(uniform_color, properties._sufColor.x, properties._sufColor.y, properties._sufColor.z, properties._sufColor.w);
-	glBindBuffer(GL_ARRAY_BUFFER, _bufferGraphSurface);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, vertexDimensions, GL_FLOAT, GL_FALSE, 0, 0);
-	glDrawElements(GL_TRIANGLE_STRIP, triangleVertexCount, GL_UNSIGNED_INT, (void*)indexBuffer);
-	glDisableVertexAttribArray(0);
+// The restart index as read from element buffers of "type"
+static GLuint restartIndex(GLenum type)
+{
+	return type == GL_UNSIGNED_SHORT ? 0xffff : Graph::restart_index;
+}
 
-	vector<GLuint> outlineBuffers = { _bufferHorizontalOutlineZupper, _bufferHorizontalOutlineZlower,
-		_bufferHorizontalOutlineXlower, _bufferHorizontalOutlineXupper };
+static size_t indexSize(GLenum type)
+{
+	return type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+}
 
-	for (int i = 0; i < outlineBuffers.size(); i++)
+/*
+Copies the mesh into the vertex buffers, which have room for up to twice the drawn slots within "maxPatches", so moving
+the camera rarely reallocates them. They shrink once 4 times too large, e.g. after the memory budget was lowered
+A mesh the job built in the buffers' mapped regions is already there, the capacity it fit keeps Map handing out the same
+regions. Mapping is retried when the written vertices are lost, the previous mesh stays drawn if that keeps happening
+*/
+bool Graph::Upload(GraphJobResult& mesh, size_t maxPatches)
+{
+	ProfileScope scope("Upload", id);
+	bool quantized = mesh.quantized;
+	bool mapped = mesh.mappedSlopes != nullptr;
+	size_t slots = std::max<size_t>(1, mesh.patches.size() / 4);
+	if (!fitsCapacity(slots, _slotCapacity)) _slotCapacity = std::max(slots, std::min(2 * slots, maxPatches));
+	size_t vertices = _slotCapacity * patch_vertices;
+	size_t heightSize = quantized ? sizeof(GLushort) : sizeof(GLfloat);
+	for (int attempt = 0; attempt < 3; attempt++)
 	{
-		// color for Z outlines
-		if (i == 0) glUniform4f(uniform_color, properties._outlineColorZ.x, properties._outlineColorZ.y, properties._outlineColorZ.z, properties._outlineColorZ.w);
-		// color for X outlines
-		else if (i == 2) glUniform4f(uniform_color, properties._outlineColorX.x, properties._outlineColorX.y, properties._outlineColorX.z, properties._outlineColorX.w);
+		char* heights = (char*)_bufferGraphHeights.Map(vertices * heightSize);
+		GLushort* slopes = (GLushort*)_bufferGraphSlopes.Map(vertices * 2 * sizeof(GLushort));
+		if (mapped && (heights != mesh.mappedHeights || slopes != mesh.mappedSlopes))
+		{
+			// The buffers were reallocated since, the mesh is lost with their old storage
+			heights = nullptr;
+			slopes = nullptr;
+		}
+		else if (!mapped)
+		{
+			if (heights != nullptr && quantized) std::copy(mesh.quantizedHeights.begin(), mesh.quantizedHeights.end(), (GLushort*)heights);
+			else if (heights != nullptr) std::copy(mesh.heights.begin(), mesh.heights.end(), (GLfloat*)heights);
+			if (slopes != nullptr) std::copy(mesh.slopes.begin(), mesh.slopes.end(), slopes);
+		}
 
-		glBindBuffer(GL_ARRAY_BUFFER, outlineBuffers[i]);
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, vertexDimensions, GL_FLOAT, GL_FALSE, 0, 0);
-		for (int j = 0; j < vertexCount; j++) {
-			glDrawArrays(GL_LINE_STRIP, j * vertexCount, vertexCount);
+		bool valid = true;
+		if (heights != nullptr) valid &= _bufferGraphHeights.Unmap();
+		if (slopes != nullptr) valid &= _bufferGraphSlopes.Unmap();
+		if (heights == nullptr || slopes == nullptr) break;
+		if (!valid) continue;
+
+		bool created = _patchBuffer == 0;
+		if (created) glGenBuffers(1, &_patchBuffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, _patchBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, mesh.patches.size() * sizeof(GLfloat), mesh.patches.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		// The buffer only exists once bound, the texture keeps following it from then on
+		if (created)
+		{
+			glGenTextures(1, &_patchTexture);
+			glBindTexture(GL_TEXTURE_BUFFER, _patchTexture);
+			glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, _patchBuffer);
+			glBindTexture(GL_TEXTURE_BUFFER, 0);
+		}
+
+		vector<GLuint>& outlines = mesh.outlineIndicesZ;
+		outlines.insert(outlines.end(), mesh.outlineIndicesX.begin(), mesh.outlineIndicesX.end());
+		if (_outlineBuffer == 0) glGenBuffers(1, &_outlineBuffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _outlineBuffer);
+		_outlineIndexType = fillElementBuffer(outlines, mesh.patches.size() / 4 * patch_vertices, GL_STREAM_DRAW);
+		_outlineIndicesZ = outlines.size() - mesh.outlineIndicesX.size();
+		_outlineIndicesX = mesh.outlineIndicesX.size();
+
+		_quantized = quantized;
+		_attributesStale = true;
+		_heightScale = mesh.heightScale;
+		_heightBias = mesh.heightBias;
+		_slots.resize(mesh.patches.size() / 4);
+		for (size_t slot = 0; slot < _slots.size(); slot++)
+		{
+			const GLfloat* patch = &mesh.patches[slot * 4];
+			GLfloat side = patch[2] * patch_samples;
+			_slots[slot] = { { patch[0], mesh.heightRanges[slot * 2], patch[1] },
+				{ patch[0] + side, mesh.heightRanges[slot * 2 + 1], patch[1] + side },
+				mesh.outlineStartsZ[slot], mesh.outlineStartsX[slot] };
+		}
+		return true;
+	}
+
+	// The buffers hold a partial mesh now, drawing nothing until the next one is better than drawing garbage
+	_slots.clear();
+	_outlineIndicesZ = 0;
+	_outlineIndicesX = 0;
+	_rebuild = true;
+	return false;
+}
+
+/*
+Draws the graph surface and outlines from the heights and slopes of the last uploaded mesh
+Slots out of the frustum are skipped, every run of consecutive slots in it is drawn as one range of each part's indices
+*/
+void Graph::Draw(const PatchIndices& indices, const GraphUniforms& uniforms, const GraphProperties& properties, const ViewFrustum& frustum)
+{
+	if (_slots.empty()) return;
+	ProfileScope scope("Draw graph", id);
+	vector<size_t> runs; // First and end slot of every run
+	for (size_t slot = 0; slot < _slots.size(); slot++)
+	{
+		if (!frustum.Intersects(_slots[slot].lo, _slots[slot].hi)) continue;
+		if (!runs.empty() && runs.back() == slot) runs.back() = slot + 1;
+		else
+		{
+			runs.push_back(slot);
+			runs.push_back(slot + 1);
+		}
+	}
+	if (runs.empty()) return;
+
+	vector<GLsizei> counts(runs.size() / 2);
+	vector<const void*> offsets(runs.size() / 2);
+	// "first" gives the first index of a slot, or the end of the last slot's indices
+	auto drawRuns = [&](GLenum mode, GLenum type, const std::function<size_t(size_t slot)>& first)
+	{
+		for (size_t r = 0; r < counts.size(); r++)
+		{
+			size_t begin = first(runs[r * 2]);
+			counts[r] = (GLsizei)(first(runs[r * 2 + 1]) - begin);
+			offsets[r] = (const void*)(begin * indexSize(type));
 		}
-		glDisableVertexAttribArray(0);
+		glMultiDrawElements(mode, counts.data(), type, offsets.data(), (GLsizei)counts.size());
+	};
+
+	glUseProgram(_heightfieldProgram);
+	if (_vertexArray == 0) glGenVertexArrays(1, &_vertexArray);
+	glBindVertexArray(_vertexArray);
+	if (_attributesStale)
+	{
+		glEnableVertexAttribArray(0);
+		_bufferGraphHeights.BindAttribute(0, 1, _quantized ? GL_UNSIGNED_SHORT : GL_FLOAT);
+		glEnableVertexAttribArray(1);
+		_bufferGraphSlopes.BindAttribute(1, 2, GL_HALF_FLOAT);
+		_attributesStale = false;
+	}
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_BUFFER, _patchTexture);
+	glUniform1i(uniforms.quantized, _quantized);
+	glUniform1f(uniforms.heightScale, _heightScale);
+	glUniform1f(uniforms.heightBias, _heightBias);
+
+	glUniform1i(uniforms.isLit, properties._lighting);
+	glUniform1i(uniforms.part, PART_SURFACE);
+	// The surface is pushed back in depth, so outlines lying on it are drawn over it from either side
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(1, 1);
+	glEnable(GL_PRIMITIVE_RESTART);
+	glPrimitiveRestartIndex(restartIndex(indices.indexType));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices.elementBuffer);
+	{
+		GpuProfileScope gpuScope("Surface", id);
+		drawRuns(GL_TRIANGLE_STRIP, indices.indexType, [&](size_t slot) { return slot * indices.indicesPerSlot; });
+	}
+	glDisable(GL_POLYGON_OFFSET_FILL);
+
+	// Outlines are drawn unlit, one line strip per line, all lines of a direction in one call
+	glUniform1i(uniforms.isLit, false);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _outlineBuffer);
+	glPrimitiveRestartIndex(restartIndex(_outlineIndexType));
+	{
+		GpuProfileScope gpuScope("Outlines", id);
+		glUniform1i(uniforms.part, PART_OUTLINE_Z);
+		drawRuns(GL_LINE_STRIP, _outlineIndexType, [&](size_t slot)
+		{
+			return slot < _slots.size() ? _slots[slot].outlineZ : _outlineIndicesZ;
+		});
+		glUniform1i(uniforms.part, PART_OUTLINE_X);
+		drawRuns(GL_LINE_STRIP, _outlineIndexType, [&](size_t slot)
+		{
+			return _outlineIndicesZ + (slot < _slots.size() ? _slots[slot].outlineX : _outlineIndicesX);
+		});
+	}
+	glDisable(GL_PRIMITIVE_RESTART);
+
+	_bufferGraphHeights.Fence();
+	_bufferGraphSlopes.Fence();
+}
+
+/*
+Draws the graph surface and outlines with the graph's own program, the vertex shader computes the heights and normals
+of the grid for the current zoom, so nothing has to be generated on the CPU
+*/
+void Graph::DrawGpu(const GraphGrid& grid, double sampleSize, const GraphProperties& properties)
+{
+	if (grid.tiles == 0) return;
+	ProfileScope scope("Draw graph", id);
+	const GraphUniforms& uniforms = _gpuEquation->Uniforms();
+	glUseProgram(_gpuEquation->Program());
+	glBindVertexArray(grid.vertexArray);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_BUFFER, grid.tileTexture);
+	glUniform1f(uniforms.sampleSize, (GLfloat)sampleSize);
+
+	glUniform1i(uniforms.isLit, properties._lighting);
+	glUniform1i(uniforms.part, PART_SURFACE);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(1, 1);
+	glEnable(GL_PRIMITIVE_RESTART);
+	glPrimitiveRestartIndex(restartIndex(grid.indexType));
+	{
+		GpuProfileScope gpuScope("Surface", id);
+		glDrawElementsInstanced(GL_TRIANGLE_STRIP, (GLsizei)grid.triangleIndices, grid.indexType, 0, (GLsizei)grid.tiles);
 	}
+	glDisable(GL_POLYGON_OFFSET_FILL);
 
-	// Revert shader changes
-	glUniform1i(uniform_isGradient, false);
+	glUniform1i(uniforms.isLit, false);
+	{
+		GpuProfileScope gpuScope("Outlines", id);
+		size_t offset = grid.triangleIndices * indexSize(grid.indexType);
+		glUniform1i(uniforms.part, PART_OUTLINE_Z);
+		glDrawElementsInstanced(GL_LINE_STRIP, (GLsizei)grid.outlineIndicesZ, grid.indexType, (void*)offset, (GLsizei)grid.tiles);
+		offset += grid.outlineIndicesZ * indexSize(grid.indexType);
+		glUniform1i(uniforms.part, PART_OUTLINE_X);
+		glDrawElementsInstanced(GL_LINE_STRIP, (GLsizei)grid.outlineIndicesX, grid.indexType, (void*)offset, (GLsizei)grid.tiles);
+	}
+	glDisable(GL_PRIMITIVE_RESTART);
 }
 
-void Graph::SetEquation(unique_ptr<EquationNode> graphEquation)
+void Graph::SetEquation(EquationProgram graphEquation)
 {
 	_graphEquation = std::move(graphEquation);
+	_gpuEquation = nullptr;
 }
 
-void Graph::bindVertexBuffer(GLuint& GLbuffer, position* vertexBuffer, size_t size)
+/*
+Switches the equation between native code and the interpreter, returns false if native code isn't available
+*/
+bool Graph::SetNativeEquation(bool native)
 {
-	glGenBuffers(1, &GLbuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, GLbuffer);
-	glBufferData(GL_ARRAY_BUFFER, size, vertexBuffer, GL_STATIC_DRAW);
-	
+	if (!native)
+	{
+		_graphEquation.ReleaseNative();
+		return true;
+	}
+	return _graphEquation.IsNative() || _graphEquation.CompileNative();
+}
+
+/*
+Switches between drawing with the equation evaluated on the GPU and drawing generated vertices
+Returns false if the equation's shaders don't compile, the graph then has to be generated on the CPU
+*/
+bool Graph::SetGpuEquation(bool gpu)
+{
+	_gpuEquation = nullptr;
+	// The buffers were left as they were while on the GPU
+	_rebuild = true;
+	if (!gpu) return true;
+
+	unique_ptr<GpuEquation> gpuEquation(new GpuEquation(_graphEquation));
+	if (gpuEquation->Program() == 0) return false;
+	_gpuEquation = std::move(gpuEquation);
+	return true;
+}
+
+/*
+Planes of the camera's view and projection matrices combined (Gribb and Hartmann). The shaders turn row vectors,
+position * xRMatrix * yRMatrix, which is turning column vectors by the transposed matrices
+*/
+ViewFrustum ViewFrustum::FromView(const GLfloat perspective[16], const GLfloat offset[3], const GLfloat angle[2])
+{
+	double cosX = cos(angle[0]), sinX = sin(angle[0]), cosY = cos(angle[1]), sinY = sin(angle[1]);
+	const double view[3][4] = {
+		{ cosX, 0, sinX, offset[0] },
+		{ sinY * sinX, cosY, -sinY * cosX, offset[1] },
+		{ -cosY * sinX, sinY, cosY * cosX, offset[2] }
+	};
+
+	// perspective is column major
+	double clip[4][4];
+	for (int i = 0; i < 4; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			clip[i][j] = j == 3 ? perspective[12 + i] : 0;
+			for (int k = 0; k < 3; k++) clip[i][j] += perspective[k * 4 + i] * view[k][j];
+		}
+	}
+
+	ViewFrustum frustum;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			frustum.planes[axis * 2][j] = (GLfloat)(clip[3][j] + clip[axis][j]);
+			frustum.planes[axis * 2 + 1][j] = (GLfloat)(clip[3][j] - clip[axis][j]);
+		}
+	}
+	return frustum;
+}
+
+// The box is outside if even its corner furthest along a plane's normal is behind it
+bool ViewFrustum::Intersects(const GLfloat lo[3], const GLfloat hi[3]) const
+{
+	for (const GLfloat* plane : planes)
+	{
+		GLfloat distance = plane[3];
+		for (int axis = 0; axis < 3; axis++) distance += plane[axis] * (plane[axis] >= 0 ? hi[axis] : lo[axis]);
+		if (distance < 0) return false;
+	}
+	return true;
 }
 
 //
@@ -175,17 +834,43 @@ void Graph::bindVertexBuffer(GLuint& GLbuffer, position* vertexBuffer, size_t si
 GraphManager::GraphManager(GLuint program, vector<pair<string, void*>>* windowVars) : _program(program)
 {
 	_curId = 0;
-	_vars.push_back({ 'x', 0 });
-	_vars.push_back({ 'z', 0 });
+	_varNames.push_back('x');
+	_varNames.push_back('z');
 
 	_sampleCount = 30;
 	_resolution = 4;
+	_memoryBudget = default_memory_budget;
 
 	_graphZoom = nullptr;
-	_indexBuff = nullptr;
 	_curGraphZoom = 1;
 
 	_focused = false;
+	_nativeEquations = false;
+	_gpuEquations = false;
+	_quantizedHeights = false;
+	_view = {};
+	for (int i = 0; i < 4; i++) _view.perspective[i * 5] = 1;
+	_viewportHeight = 1;
+	GLint vertexArray = 0;
+	glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vertexArray);
+	_vertexArray = vertexArray;
+
+	_heightfieldProgram = LinkGraphProgram(&heightfield_vertex_shader, 1);
+	_heightfieldUniforms = GetGraphUniforms(_heightfieldProgram);
+	// The patches are always read from the first texture unit
+	glUseProgram(_heightfieldProgram);
+	glUniform1i(glGetUniformLocation(_heightfieldProgram, "patches"), 0);
+	glUniform1i(glGetUniformLocation(_heightfieldProgram, "patchSide"), Graph::patch_samples + 1);
+	glUseProgram(_program);
+
+	glGenBuffers(1, &_viewBuffer);
+	glGenBuffers(1, &_styleBuffer);
+	GLint alignment = 1;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	_styleStride = (3 * sizeof(ImVec4) + alignment - 1) / alignment * alignment;
+	buildPatchIndices(MaxPatches());
+	// At least one worker besides the render thread, so the graphs' jobs run in the background
+	_threadPool.reset(new ThreadPool(std::max<size_t>(2, ThreadPool::DefaultThreadCount())));
 
 	if (windowVars == nullptr) return;
 	for (auto var : *windowVars)
@@ -196,53 +881,108 @@ GraphManager::GraphManager(GLuint program, vector<pair<string, void*>>* windowVa
 			_curGraphZoom = *_graphZoom;
 		}
 	}
+}
 
-	generateIndecies();
+GraphManager::~GraphManager()
+{
+	// Jobs write to their graphs
+	_threadPool->Wait(_jobs);
+	if (_grid.vertexArray != 0) glDeleteVertexArrays(1, &_grid.vertexArray);
+	if (_grid.vertexBuffer != 0) glDeleteBuffers(1, &_grid.vertexBuffer);
+	if (_grid.elementBuffer != 0) glDeleteBuffers(1, &_grid.elementBuffer);
+	if (_grid.tileTexture != 0) glDeleteTextures(1, &_grid.tileTexture);
+	if (_grid.tileBuffer != 0) glDeleteBuffers(1, &_grid.tileBuffer);
+	glDeleteBuffers(1, &_patchIndices.elementBuffer);
+	glDeleteBuffers(1, &_viewBuffer);
+	glDeleteBuffers(1, &_styleBuffer);
+	// Shared by the graphs, which don't free it
+	if (_heightfieldProgram != 0) glDeleteProgram(_heightfieldProgram);
 }
 
 void GraphManager::Draw()
 {
 	_focused = false;
-	for (GraphEditor& e : _graphEditors)
+	takeJobResults();
 	{
-		e.Draw();
+		ProfileScope scope("Graph editors");
+		for (GraphEditor& e : _graphEditors)
+		{
+			e.Draw();
+		}
 	}
 
-	// Force zoom updates
 	// TODO: Might want to delete this and instead handle the zoom callback itself in GraphManager
-	if (_curGraphZoom != *_graphZoom)
+	_curGraphZoom = *_graphZoom;
+
+	// Graphs follow the camera and the zoom, those evaluated on the GPU do on their own
+	vector<Graph*> visible;
+	for (Graph& g : _graphs)
 	{
-		_curGraphZoom = *_graphZoom;
+		if (g.show && !g.IsGpu()) visible.push_back(&g);
+	}
+	{
+		ProfileScope scope("Request graphs");
+		updateGraphs(visible);
+		startJobs();
+	}
+
+	// Graphs and editors are both kept in the order of their ids, removed graphs have no editor
+	vector<pair<Graph*, const GraphProperties*>> drawn;
+	auto e = _graphEditors.begin();
+	for (Graph& g : _graphs)
+	{
+		while (e != _graphEditors.end() && e->id < g.id) e++;
+		if (g.show && e != _graphEditors.end() && e->id == g.id) drawn.emplace_back(&g, &e->_prop);
+	}
+	if (drawn.empty()) return;
+
+	// Every drawn graph's colors go into one buffer, each range of it is bound as the graph's GraphStyle block in turn
+	vector<char> styles(drawn.size() * _styleStride);
+	for (size_t k = 0; k < drawn.size(); k++)
+	{
+		const GraphProperties& properties = *drawn[k].second;
+		ImVec4 colors[3] = { properties._sufColor, properties._outlineColorZ, properties._outlineColorX };
+		memcpy(styles.data() + k * _styleStride, colors, sizeof(colors));
+	}
+	glBindBuffer(GL_UNIFORM_BUFFER, _styleBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, styles.size(), styles.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	updateView();
+	if (std::any_of(drawn.begin(), drawn.end(), [](const pair<Graph*, const GraphProperties*>& d) { return d.first->IsGpu(); }))
+	{
+		updateGridTiles();
+	}
 
-		for (Graph& g : _graphs)
+	for (size_t k = 0; k < drawn.size(); k++)
+	{
+		Graph& g = *drawn[k].first;
+		glBindBufferRange(GL_UNIFORM_BUFFER, GRAPH_STYLE_BINDING, _styleBuffer, k * _styleStride, 3 * sizeof(ImVec4));
+		if (g.IsGpu()) g.DrawGpu(_grid, exp(_curGraphZoom), *drawn[k].second);
+		else
 		{
-			if(g.show) g.Generate(exp(_curGraphZoom), _sampleCount, _resolution);
+			// Balancing the patches may run a little over the budget the indices were made for
+			if (g.DrawnSlots() > _patchIndices.slots) buildPatchIndices(g.DrawnSlots());
+			g.Draw(_patchIndices, _heightfieldUniforms, *drawn[k].second, _frustum);
 		}
 	}
-	
-	for (Graph& g : _graphs)
-	{	
-		auto e = std::find_if(_graphEditors.begin(), _graphEditors.end(), [&g](GraphEditor& e) { return g.id == e.id; });
-		if (g.show) g.Draw(_sampleCount, _resolution, _indexBuff, e->_prop);
-	}
+
+	// The axes are drawn with the main program
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindVertexArray(_vertexArray);
+	glUseProgram(_program);
 }
 
 size_t GraphManager::NewGraph(string equation)
 {
-	unique_ptr<EquationNode> eqHead = GenerateEquationTree(equation, _vars);
-
-	size_t pos_x; size_t pos_z;
-	for (size_t i = 0; i < _vars.size(); i++)
-	{
-		if (_vars[i].first == 'x') pos_x = i;
-		else if (_vars[i].first == 'z') pos_z = i;
-	}
+	ProfileScope scope("New graph");
+	EquationTree tree = SimplifyEquationTree(GenerateEquationTree(equation, _varNames));
 
-	_graphs.push_back({ ++_curId, _program, _vars[pos_x].second, _vars[pos_z].second, std::move(eqHead) });
+	_graphs.emplace_back(++_curId, _heightfieldProgram, CompileEquation(tree, _varNames));
+	if (_nativeEquations) _graphs.back().SetNativeEquation(true);
 	
-	double sampleSize = 1;
-	if (_graphZoom != nullptr) sampleSize = exp(*_graphZoom);
-	_graphs.back().Generate(sampleSize, _sampleCount, _resolution);
+	if (_graphZoom != nullptr) _curGraphZoom = *_graphZoom;
+	if (!_gpuEquations || !_graphs.back().SetGpuEquation(true)) updateGraphs({ &_graphs.back() });
+	startJobs();
 
 	// Create new editor window
 	GraphEditor e(_curId, this, equation);
@@ -263,63 +1003,415 @@ size_t GraphManager::RemoveGraph(size_t graphId)
 	return 0;
 }
 
-void GraphManager::UpdateEquation(size_t graphId, string equation)
+/*
+The graph keeps its equation if the new one is invalid, its editor then shows the error
+Edits made while the graph's job runs cancel the job, only the latest one is compiled
+*/
+void GraphManager::UpdateEquation(size_t graphId, string_view equation)
+{
+	auto graph = std::find_if(_graphs.begin(), _graphs.end(), [graphId](Graph& g) {return g.id == graphId; });
+	// On the GPU an edit only costs compiling the graph's shaders once compiled, the graph isn't generated
+	GraphRequest request = graph->IsGpu() ? GraphRequest() : lodRequest();
+	request.edit = true;
+	request.equation = string(equation);
+	request.native = _nativeEquations;
+	graph->Request(std::move(request));
+	startJobs();
+}
+
+const EquationProgram& GraphManager::GetEquation(size_t graphId)
 {
-	unique_ptr<EquationNode> eqHead = GenerateEquationTree(equation, _vars);
 	auto graph = std::find_if(_graphs.begin(), _graphs.end(), [graphId](Graph& g) {return g.id == graphId; });
-	graph->SetEquation(std::move(eqHead));
-	graph->Generate(exp(_curGraphZoom), _sampleCount, _resolution);
+	return graph->GetEquation();
+}
+
+/*
+Evaluates all graphs with natively compiled equations, or back with the interpreter
+Returns false if native code isn't available, in which case the interpreter stays in use
+*/
+bool GraphManager::SetNativeEquations(bool native)
+{
+	if (native && !NativeEquation::Available()) return false;
+
+	_nativeEquations = native;
+	bool success = true;
+	for (Graph& g : _graphs)
+	{
+		success &= g.SetNativeEquation(native);
+	}
+	return success;
+}
 
+/*
+Draws all graphs with their equations evaluated in the vertex shader, zooming then regenerates nothing on the CPU
+Returns false if some equation's shaders didn't compile, those graphs are still generated on the CPU
+*/
+bool GraphManager::SetGpuEquations(bool gpu)
+{
+	if (gpu && _grid.vertexBuffer == 0) buildGrid();
+
+	_gpuEquations = gpu;
+	bool success = true;
+	vector<Graph*> stale;
+	for (Graph& g : _graphs)
+	{
+		bool wasGpu = g.IsGpu();
+		success &= g.SetGpuEquation(gpu);
+		// No vertices are generated while on the GPU, the camera, zoom and equation may have changed since
+		if (wasGpu && !g.IsGpu()) stale.push_back(&g);
+	}
+	updateGraphs(stale);
+	return success;
+}
+
+/*
+Graphs generated on the CPU are built again for the new patch budget by their next jobs, the GPU grid's tile right away
+*/
+void GraphManager::SetGridSize(size_t sampleCount, size_t resolution)
+{
+	resolution = std::max<size_t>(1, resolution);
+	_sampleCount = std::max<size_t>(1, sampleCount);
+	_resolution = resolution;
+	if (_grid.vertexBuffer != 0 && gridResolution() != _grid.resolution) buildGrid();
+	for (Graph& g : _graphs)
+	{
+		g.Rebuild();
+	}
+}
+
+/*
+Lowering the budget frees memory once the graphs' next meshes are uploaded, their buffers are sized for the budget
+*/
+void GraphManager::SetMemoryBudget(size_t bytes)
+{
+	_memoryBudget = bytes;
+	if (_grid.vertexBuffer != 0 && gridResolution() != _grid.resolution) buildGrid();
+	for (Graph& g : _graphs)
+	{
+		g.Rebuild();
+	}
+}
+
+/*
+Graphs are built again in the new format by their next jobs, until then they're drawn in the old one
+*/
+void GraphManager::SetQuantizedHeights(bool quantized)
+{
+	_quantizedHeights = quantized;
+	for (Graph& g : _graphs)
+	{
+		g.Rebuild();
+	}
 }
 
 /*
-Generates triangle indicies for the vertices of the graph surface
-This is in GraphManager because the resolution and sample count are uniform for all graphs, and thus so are the indecies
+Quads a drawn unit of the GPU grid. A tile holds at least one unit, and the whole grid draws no more vertices than the
+memory budget allows a graph generated on the CPU, so the grid's size stays bounded whatever the resolution
 */
-void GraphManager::generateIndecies()
+size_t GraphManager::gridResolution() const
 {
-	// The Indecies are a bit wider than the graph. This is because we need to generate "degenerate" triangles (with area 0) which
-	// won't be drawn by opengl, so that we can render all the triangles in one strip that is cut at the edges of the graph.
-	// We do this by adding duplicate indecies at the edges.
-	// Note: We add 2 duplicate indecies per row, to perserve the orientation of the triangles by keeping the index count even.
+	double vertices = (double)std::min(_memoryBudget / Graph::patch_bytes, Graph::max_patches) * Graph::patch_vertices;
+	double budget = sqrt(vertices) / (2 * Graph::lod_extent);
+	return std::max<size_t>(1, std::min({ _resolution, grid_tile_quads, (size_t)budget }));
+}
 
-	delete _indexBuff;
+/*
+Fills the buffers of the grid's tile, the tile and its indices are the same for every graph and zoom
+*/
+void GraphManager::buildGrid()
+{
+	// Tiles cover the same square as the patches of graphs drawn on the CPU, with outlines on every drawn unit
+	const size_t resolution = gridResolution();
+	size_t units = 1;
+	while (units < 2 * Graph::lod_extent && units * 2 * resolution <= grid_tile_quads) units *= 2;
+	const size_t quads = units * resolution, width = quads + 1;
+	_grid.resolution = resolution;
+	_grid.tileSide = (double)units;
+	vector<GLfloat> vertices;
+	vertices.reserve(width * width * 2);
+	for (size_t i = 0; i < width; i++)
+	{
+		for (size_t j = 0; j < width; j++)
+		{
+			vertices.push_back((GLfloat)j / resolution);
+			vertices.push_back((GLfloat)i / resolution);
+		}
+	}
 
-	GLuint graphWidth = _sampleCount * _resolution * Graph::graph_sides;
-	GLuint estimatedIndecies = pow((graphWidth) + Graph::duplicate_rowindecies, 2) * Graph::index_repeats;
-	_indexBuff = (GLuint*)malloc(estimatedIndecies * sizeof(GLuint));
+	vector<GLuint> indices;
+	AppendGridStrips(indices, 0, width, quads, Graph::strip_tile);
+	_grid.triangleIndices = indices.size();
 
-	//Index buffer for triangle elements
-	unsigned int index = 0;
-	int j = 0;
-	for (int i = 0; i < graphWidth - 1; i++)
+	for (size_t edge = 0; edge < width; edge += resolution)
 	{
-		j = 0;
-		// First duplicate index ahead of the row to create a degenrate triangle
-		_indexBuff[index] = (i * graphWidth) + j;
-		index++;
+		for (size_t s = 0; s < width; s++)
+		{
+			indices.push_back(s * width + edge);
+		}
+		indices.push_back(Graph::restart_index);
+	}
+	_grid.outlineIndicesZ = indices.size() - _grid.triangleIndices;
 
-		// Real triangle indecies
-		for (; j < graphWidth; j++)
+	for (size_t edge = 0; edge < width; edge += resolution)
+	{
+		for (size_t s = 0; s < width; s++)
 		{
-			_indexBuff[index] = (i * graphWidth) + j;
-			index++;
+			indices.push_back(edge * width + s);
+		}
+		indices.push_back(Graph::restart_index);
+	}
+	_grid.outlineIndicesX = indices.size() - _grid.triangleIndices - _grid.outlineIndicesZ;
+
+	// Built again when the resolution changes, into the same objects
+	bool created = _grid.vertexArray == 0;
+	if (created)
+	{
+		glGenVertexArrays(1, &_grid.vertexArray);
+		glGenBuffers(1, &_grid.vertexBuffer);
+		glGenBuffers(1, &_grid.elementBuffer);
+		glGenBuffers(1, &_grid.tileBuffer);
+	}
+	glBindVertexArray(_grid.vertexArray);
+	glBindBuffer(GL_ARRAY_BUFFER, _grid.vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _grid.elementBuffer);
+	_grid.indexType = fillElementBuffer(indices, width * width, GL_STATIC_DRAW);
+	glBindVertexArray(_vertexArray);
+
+	// The buffer only exists once bound, the texture keeps following it from then on
+	if (created)
+	{
+		glBindBuffer(GL_TEXTURE_BUFFER, _grid.tileBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, 0, nullptr, GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		glGenTextures(1, &_grid.tileTexture);
+		glBindTexture(GL_TEXTURE_BUFFER, _grid.tileTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32F, _grid.tileBuffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+	}
+	_grid.tiles = 0;
+}
 
-			_indexBuff[index] = ((i + 1) * graphWidth) + j;
-			index++;
+/*
+Writes the corners of the grid's tiles within the frustum into the tiles texture, once a frame. Heights on the GPU aren't
+known here, a tile's box spans the whole drawn range
+*/
+void GraphManager::updateGridTiles()
+{
+	const size_t tiles = (size_t)(2 * Graph::lod_extent / _grid.tileSide);
+	const GLfloat side = (GLfloat)_grid.tileSide;
+	vector<GLfloat> corners;
+	for (size_t i = 0; i < tiles; i++)
+	{
+		for (size_t j = 0; j < tiles; j++)
+		{
+			GLfloat x = (GLfloat)(-Graph::lod_extent + j * _grid.tileSide), z = (GLfloat)(-Graph::lod_extent + i * _grid.tileSide);
+			GLfloat lo[3] = { x, (GLfloat)-Graph::view_height, z }, hi[3] = { x + side, (GLfloat)Graph::view_height, z + side };
+			if (!_frustum.Intersects(lo, hi)) continue;
+			corners.push_back(x);
+			corners.push_back(z);
 		}
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, _grid.tileBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, corners.size() * sizeof(GLfloat), corners.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	_grid.tiles = corners.size() / 2;
+}
+
+/*
+Fills the patch indices for "slots" slots of patch vertices, the same for every graph
+*/
+void GraphManager::buildPatchIndices(size_t slots)
+{
+	const size_t n = Graph::patch_samples + 1;
+	vector<GLuint> indices;
+	for (size_t slot = 0; slot < slots; slot++)
+	{
+		AppendGridStrips(indices, slot * n * n, n, Graph::patch_samples, Graph::strip_tile);
+	}
+
+	if (_patchIndices.elementBuffer == 0) glGenBuffers(1, &_patchIndices.elementBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _patchIndices.elementBuffer);
+	_patchIndices.indexType = fillElementBuffer(indices, slots * n * n, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	_patchIndices.slots = slots;
+	_patchIndices.indicesPerSlot = slots > 0 ? indices.size() / slots : 0;
+}
+
+void GraphManager::SetCamera(const GLfloat perspective[16], const GLfloat offset[3], const GLfloat angle[2], int viewportHeight)
+{
+	for (int r = 0; r < 4; r++)
+	{
+		for (int c = 0; c < 4; c++) _view.perspective[c * 4 + r] = perspective[r * 4 + c];
+	}
+	std::copy(offset, offset + 3, _view.offset);
+	std::copy(angle, angle + 2, _view.angle);
+	_viewportHeight = std::max(1, viewportHeight);
+}
+
+/*
+Writes the camera of the last SetCamera into the GraphView block the graph programs share
+*/
+void GraphManager::updateView()
+{
+	_frustum = ViewFrustum::FromView(_view.perspective, _view.offset, _view.angle);
+
+	glBindBuffer(GL_UNIFORM_BUFFER, _viewBuffer);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(_view), &_view, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, GRAPH_VIEW_BINDING, _viewBuffer);
+}
+
+/*
+Camera of the last SetCamera, in the drawn units of the graphs' vertices
+*/
+LodCamera GraphManager::lodCamera() const
+{
+	const GLfloat* offset = _view.offset;
+	const GLfloat* angle = _view.angle;
+
+	// Undo the offset, then the rotations of vertex_shader in reverse order, each rotating back by its angle
+	double x = -offset[0], y = -offset[1], z = -offset[2];
+	double cosY = cos(angle[1]), sinY = sin(angle[1]);
+	double rotatedY = cosY * y + sinY * z;
+	z = -sinY * y + cosY * z;
+	y = rotatedY;
+	double cosX = cos(angle[0]), sinX = sin(angle[0]);
+	double rotatedX = cosX * x - sinX * z;
+	z = sinX * x + cosX * z;
+	x = rotatedX;
+
+	// perspective[5] is the frustum scale, a unit at distance 1 spans half the viewport's height times that
+	return { x, y, z, _view.perspective[5] * _viewportHeight / 2.0 };
+}
+
+/*
+Patches a graph can be drawn with, as many vertices as the sampleCount * resolution grid a side had, as far as the
+memory budget and Graph::max_patches allow. The grid's count is a double, it may not fit 64 bits
+*/
+size_t GraphManager::MaxPatches() const
+{
+	double samples = (double)Graph::graph_sides * _sampleCount * _resolution;
+	double patches = samples * samples / Graph::patch_vertices;
+	size_t limit = std::min(_memoryBudget / Graph::patch_bytes, Graph::max_patches);
+	return std::max<size_t>(1, patches < limit ? (size_t)patches : limit);
+}
+
+/*
+The drawn square spans +-lod_extent units, sampleSize apart in the equation's coordinates like the graph's patches
+Graphs evaluated on the GPU have an equation on the CPU too, they're exported the same way
+*/
+MeshExportResult GraphManager::ExportGraph(size_t graphId, const string& path, meshFormats format, size_t resolution)
+{
+	auto graph = std::find_if(_graphs.begin(), _graphs.end(), [graphId](Graph& g) { return g.id == graphId; });
+	if (graph == _graphs.end() || !graph->show)
+	{
+		MeshExportResult result;
+		result.error = "There's no graph with id " + std::to_string(graphId);
+		return result;
+	}
 
-		// Second duplicate index infront of the row
-		_indexBuff[index] = ((i + 1) * graphWidth) + (j - 1);
-		index++;
+	if (resolution == 0) resolution = Graph::graph_sides * _sampleCount * _resolution;
+	double extent = Graph::lod_extent * exp(_curGraphZoom);
+	return ExportMesh(graph->GetEquation(), path, format, extent, resolution, *_threadPool);
+}
+
+/*
+Request for the patches of the current camera and zoom
+*/
+GraphRequest GraphManager::lodRequest() const
+{
+	GraphRequest request;
+	request.generate = true;
+	request.camera = lodCamera();
+	request.sampleSize = exp(_curGraphZoom);
+	request.maxPatches = MaxPatches();
+	request.quantize = _quantizedHeights;
+	return request;
+}
+
+/*
+Queues the patches of "graphs" for the current camera and zoom, graphs whose camera and zoom didn't change are skipped
+*/
+void GraphManager::updateGraphs(const vector<Graph*>& graphs)
+{
+	if (graphs.empty()) return;
+	GraphRequest request = lodRequest();
+	for (Graph* g : graphs)
+	{
+		g->Request(request);
+	}
+}
+
+/*
+Starts the jobs of graphs with queued requests and no job running
+*/
+void GraphManager::startJobs()
+{
+	for (Graph& g : _graphs)
+	{
+		g.StartJob(*_threadPool, _jobs, _varNames);
+	}
+	// Without workers the jobs run right away, on this thread
+	if (_threadPool->ThreadCount() == 1)
+	{
+		_threadPool->Wait(_jobs);
+		takeJobResults();
+	}
+}
+
+/*
+Applies the results of finished jobs, on the render thread: new equations, their errors and the new meshes
+*/
+void GraphManager::takeJobResults()
+{
+	for (Graph& g : _graphs)
+	{
+		unique_ptr<GraphJobResult> result = g.TakeJobResult();
+		if (result == nullptr || result->cancelled) continue;
+
+		if (result->edited)
+		{
+			auto e = std::find_if(_graphEditors.begin(), _graphEditors.end(), [&g](GraphEditor& e) { return g.id == e.id; });
+			if (e != _graphEditors.end()) e->SetDiagnostic(result->diagnostic);
+			if (result->valid)
+			{
+				g.SetEquation(std::move(result->equation));
+				if (_gpuEquations) g.SetGpuEquation(true);
+			}
+		}
+		if (result->generated) g.Upload(*result, MaxPatches());
 	}
 }
 
+bool GraphManager::HasJobResults() const
+{
+	return std::any_of(_graphs.begin(), _graphs.end(), [](const Graph& g) { return g.HasJobResult(); });
+}
+
+bool GraphManager::JobsRunning() const
+{
+	return std::any_of(_graphs.begin(), _graphs.end(), [](const Graph& g) { return g.JobRunning(); });
+}
+
+/*
+Sets the number of threads generating the graphs, the render thread included
+*/
+void GraphManager::SetThreadCount(size_t threadCount)
+{
+	_threadPool->Wait(_jobs);
+	_threadPool.reset(new ThreadPool(threadCount));
+}
+
 GraphEditor::GraphEditor(size_t graphId, GraphManager* graphManager, string equation) : \
 	id(graphId), _graphManager(graphManager), _equation(equation)
 {
 	_prop._equation = "";
 	_prop._gradingIntensity = 1;
+	_prop._lighting = true;
 	_prop._sufColor = ImVec4(0.5f, 0.5f, 0.9f, 0.7f);
 	_prop._outlineColorX = ImVec4(0.8f, 0.8f, 1.0f, 1.0f);
 	_prop._outlineColorZ = ImVec4(1.0f, 0.8f, 0.8f, 1.0f);
@@ -390,17 +1482,21 @@ void GraphEditor::Draw()
 		ImGui::EndPopup();
 	}
 
+	ImGui::Checkbox("Lighting", &_prop._lighting);
+
 	ImGui::TextWrapped("Function");
 	ImGui::SameLine();
 
 	auto callbackForwarder = [](ImGuiInputTextCallbackData* data) {GraphEditor* ge = (GraphEditor*)data->UserData; return ge->TextEditCallback(data); };
 	if (ImGui::InputText("", &_equation, NULL, (ImGuiInputTextCallback)callbackForwarder, (void*)this))
 	{
-		try
-		{
-			_graphManager->UpdateEquation(id, _equation);
-		}
-		catch(EquationError err){}
+		_graphManager->UpdateEquation(id, _equation);
+	}
+	if (!_diagnostic.message.empty())
+	{
+		ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1.0f, 0.4f, 0.4f, 1.0f));
+		ImGui::TextWrapped("%s (at %zu)", _diagnostic.message.c_str(), _diagnostic.index);
+		ImGui::PopStyleColor();
 	}
 
 	if (ImGui::IsWindowFocused(ImGuiFocusedFlags_RootAndChildWindows))
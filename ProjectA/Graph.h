@@ -5,12 +5,21 @@
 #include <vector>
 #include <utility>
 
+#include <atomic>
+#include <deque>
 #include <memory>
+#include <unordered_map>
 
 #include <glew.h>
 #include <imgui.h>
 
 #include "parsing.h"
+#include "bytecode.h"
+#include "threadpool.h"
+#include "streambuffer.h"
+#include "gpuequation.h"
+#include "quadtree.h"
+#include "meshexport.h"
 
 using std::string; 
 using std::vector; 
@@ -28,65 +37,329 @@ struct GraphProperties
 	ImVec4 _outlineColorX;
 	ImVec4 _outlineColorZ;
 	double _gradingIntensity;
+	bool _lighting;
 	string _equation;
 };
 
+/*
+Clip planes of the camera the graphs are drawn with, in drawn units. A default constructed frustum contains everything
+*/
+struct ViewFrustum
+{
+	GLfloat planes[6][4] = {}; // a, b, c, d of a x + b y + c z + d >= 0 within the frustum
+
+	// Frustum of the GraphView block's camera, see shaders.h
+	static ViewFrustum FromView(const GLfloat perspective[16], const GLfloat offset[3], const GLfloat angle[2]);
+	// False if the box from "lo" to "hi" is entirely outside of the frustum
+	bool Intersects(const GLfloat lo[3], const GLfloat hi[3]) const;
+};
+
+/*
+Tile of the x/z sample grid shared by every graph evaluated on the GPU, in drawn units (coordinates divided by the
+sample size) from the tile's corner. It's drawn instanced, once for each tile of the grid in view, the corners of those
+come from the tiles texture. Its element buffer holds the tile's triangle strips, then its outlines' line strips along
+z, then along x, outlines on the tile's edges are drawn by both tiles sharing them
+*/
+struct GraphGrid
+{
+	GLuint vertexArray = 0;
+	GLuint vertexBuffer = 0;
+	GLuint elementBuffer = 0;
+	GLenum indexType = GL_UNSIGNED_INT;
+	size_t triangleIndices = 0;
+	size_t outlineIndicesZ = 0;
+	size_t outlineIndicesX = 0;
+	size_t resolution = 0; // Quads a drawn unit, see GraphManager::gridResolution
+	double tileSide = 0; // In drawn units
+	GLuint tileBuffer = 0; // x and z of the corner of every tile in view
+	GLuint tileTexture = 0;
+	size_t tiles = 0; // Tiles in view
+};
+
+/*
+Work for a graph's background job. Requests made while a job runs are merged into the graph's next job
+*/
+struct GraphRequest
+{
+	bool edit = false; // Compile "equation" and generate the graph with it
+	string equation;
+	bool native = false;
+	bool generate = false; // Pick and evaluate the patches for "camera" and "sampleSize"
+	bool rebuild = false; // Build the mesh even if the patches didn't change
+	bool quantize = false; // Build the mesh with 16 bit heights
+	LodCamera camera = {};
+	double sampleSize = 0;
+	size_t maxPatches = 0;
+	EquationProgram graphEquation; // Equation generated with when not editing
+	// Regions of the graph's vertex buffers the job may build its mesh in, with room for mappedSlots slots, see StartJob
+	void* mappedHeights = nullptr;
+	GLushort* mappedSlopes = nullptr;
+	size_t mappedSlots = 0;
+};
+
+/*
+Outcome of a graph's background job, handed over to the render thread
+*/
+struct GraphJobResult
+{
+	bool cancelled = false; // A later request made the job's work stale, nothing of it is used
+	bool edited = false; // "valid" tells whether the edit compiled into "equation", "diagnostic" holds the error otherwise
+	bool valid = false;
+	EquationProgram equation;
+	EquationDiagnostic diagnostic;
+	bool generated = false; // The job built a new mesh, see Graph::Upload
+	// Heights of the vertices as floats, or quantized (see heightfield_vertex_shader) with their scale and bias
+	bool quantized = false;
+	vector<GLfloat> heights;
+	vector<GLushort> quantizedHeights;
+	GLfloat heightScale = 1, heightBias = 0;
+	vector<GLushort> slopes; // Half floats, the x and z of the normal of every vertex
+	// The heights and slopes were written straight into the request's mapped regions instead, the vectors are empty
+	void* mappedHeights = nullptr;
+	GLushort* mappedSlopes = nullptr;
+	vector<GLfloat> patches; // x and z of the first vertex of every slot, its sample spacing and a 0
+	vector<GLfloat> heightRanges; // Lowest and highest defined height of every slot
+	vector<GLuint> outlineIndicesZ;
+	vector<GLuint> outlineIndicesX;
+	vector<size_t> outlineStartsZ; // First outline index of every slot in outlineIndicesZ
+	vector<size_t> outlineStartsX;
+};
+
+/*
+Triangle strips over every slot of patch vertices, shared by every graph generated on the CPU since their patches all
+take the same slots. A graph draws the first indicesPerSlot indices of each of its slots
+*/
+struct PatchIndices
+{
+	GLuint elementBuffer = 0;
+	GLenum indexType = GL_UNSIGNED_INT;
+	size_t slots = 0;
+	size_t indicesPerSlot = 0;
+};
+
 class Graph
 {
 public:
-	Graph(size_t id, GLuint program, double& x, double& z, unique_ptr<EquationNode> graphEquation);
-	//Graph& operator=(const Graph& other);
+	// "heightfieldProgram" is the program graphs generated on the CPU are drawn with
+	Graph(size_t id, GLuint heightfieldProgram, EquationProgram graphEquation);
+	~Graph();
+	Graph(const Graph&) = delete;
+	Graph& operator=(const Graph&) = delete;
 
-	void Generate(double sampleSize, size_t samples, size_t resolution);
-	void Draw(GLuint sampleCount, GLuint resolution, GLuint* indexBuffer, GraphProperties properties);
-	void SetEquation(unique_ptr<EquationNode> graphEquation);
+	// Queues a request for the graph's background job, cancelling the running job if the request makes it stale.
+	// Camera moves don't, they wait for the running job so a moving camera still gets meshes. Render thread only
+	void Request(GraphRequest request);
+	// Submits the queued request as the graph's job to "jobs", unless a job is still running. Render thread only
+	void StartJob(ThreadPool& threadPool, TaskGroup& jobs, const vector<char>& varNames);
+	// Takes the result of the finished job, if any. The previous mesh stays drawn until the result is written out
+	unique_ptr<GraphJobResult> TakeJobResult();
+	bool HasJobResult() const { return _mailbox.load(std::memory_order_relaxed) != nullptr; };
+	bool JobRunning() const { return _jobRunning; };
+	// Picks the patches the surface is drawn with for "camera", returns true if the leaves changed. Job only
+	bool UpdateLod(const LodCamera& camera, double sampleSize, size_t maxPatches);
+	// Writes the mesh of a finished job into the graph's buffers, on the GL thread. Returns false if it was lost
+	bool Upload(GraphJobResult& mesh, size_t maxPatches);
+	// Has the next request build the mesh again, e.g. in another format
+	void Rebuild() { _rebuild = true; };
+	// Draws the graph's slots within "frustum" with "indices", which have to cover DrawnSlots(), "uniforms" are the
+	// heightfield program's. Both draws take the camera and the graph's colors from the GraphView and GraphStyle blocks
+	// bound by the caller, and leave the graph's program and vertex array bound
+	void Draw(const PatchIndices& indices, const GraphUniforms& uniforms, const GraphProperties& properties, const ViewFrustum& frustum);
+	size_t DrawnSlots() const { return _slots.size(); };
+	// Draws the graph over the tiles of "grid" in view with its equation evaluated in the vertex shader, see SetGpuEquation
+	void DrawGpu(const GraphGrid& grid, double sampleSize, const GraphProperties& properties);
+	void SetEquation(EquationProgram graphEquation);
+	const EquationProgram& GetEquation() const { return _graphEquation; };
+	bool SetNativeEquation(bool native);
+	bool SetGpuEquation(bool gpu);
+	bool IsGpu() const { return _gpuEquation != nullptr; };
 
 	bool show;
 	const size_t id;
 
-	constexpr static size_t graph_sides = 2, duplicate_rowindecies = 2,
-		non_repeating_index_rows = 2, index_repeats = 2;
+	constexpr static size_t graph_sides = 2;
+	// Patches bounded within flat_tolerance aren't refined, patches entirely beyond +-view_height aren't drawn
+	constexpr static double flat_tolerance = 0.01, view_height = 1000;
+	// The surface covers +-lod_extent drawn units along x and z, in patches of patch_samples quads a side refined up to
+	// max_lod_level, until their quads are lod_pixels wide on screen
+	constexpr static double lod_extent = 32, lod_pixels = 4;
+	constexpr static unsigned int patch_samples = 16, max_lod_level = 10;
+	// Patches handed to a thread pool task at a time
+	constexpr static size_t patches_per_task = 4;
+	// Triangle strips cover columns of strip_tile quads. Strips, including the outlines' line strips, are cut by
+	// restart_index (0xffff in 16 bit indices)
+	constexpr static size_t strip_tile = 8;
+	constexpr static GLuint restart_index = 0xffffffff;
+	// Evaluated patches are kept while there are fewer than patch_cache_factor times the drawn ones
+	constexpr static size_t patch_cache_factor = 4;
+	// Bytes a drawn patch takes at most: its vertices and indices (about 4 a vertex) in the GL buffers and in the job's
+	// result, and the heights and slopes of the evaluated patches cached for it
+	constexpr static size_t patch_vertices = (patch_samples + 1) * (patch_samples + 1);
+	constexpr static size_t patch_bytes = patch_vertices * (2 * (sizeof(GLfloat) + 2 * sizeof(GLushort) + 4 * sizeof(GLuint)) +
+		patch_cache_factor * 3 * sizeof(GLfloat));
+	// Keeps the indices of the drawn slots, and the counts of their draws, within 31 bits
+	constexpr static size_t max_patches = 0x7fffffff / (4 * patch_vertices);
 
 private:
-	void bindVertexBuffer(GLuint& GLbuffer, position* vertexBuffer, size_t size);
-
-	unique_ptr<EquationNode> _graphEquation;
-	GLuint _bufferHorizontalOutlineXupper;
-	GLuint _bufferHorizontalOutlineXlower;
-	GLuint _bufferHorizontalOutlineZupper;
-	GLuint _bufferHorizontalOutlineZlower;
-	GLuint _bufferGraphSurface;
-	GLuint _program;
-	// TODO: Shared pointers?
-	double& _x; double& _z;
+	// Box of a drawn slot for culling, and where its outlines start in the outline buffer
+	struct Slot
+	{
+		GLfloat lo[3], hi[3];
+		size_t outlineZ, outlineX;
+	};
+
+	struct Patch
+	{
+		Interval bounds;
+		bool boundsKnown = false;
+		vector<GLfloat> heights; // Evaluated vertices, empty until the patch is first drawn
+		vector<GLfloat> slopes; // x and z of the normal of every vertex
+		size_t lastUsed = 0; // UpdateLod call the patch was last used by
+	};
+
+	void runJob(const GraphRequest& request, size_t epoch, ThreadPool& threadPool, const vector<char>& varNames);
+	bool cancelled(size_t epoch) const { return _cancelEpoch.load(std::memory_order_relaxed) != epoch; };
+	void buildMesh(GraphJobResult& result, ThreadPool& threadPool, const GraphRequest& request) const;
+	bool patchBounds(const PatchId& patch, double& lo, double& hi);
+	bool isDrawn(const Patch& patch) const;
+	void evaluatePatch(const PatchId& id, Patch& patch) const;
+
+	EquationProgram _graphEquation;
+	unique_ptr<GpuEquation> _gpuEquation;
+
+	// Render thread side of the jobs
+	GraphRequest _pending; // Merged requests for the next job
+	bool _hasPending;
+	GraphRequest _running; // Request of the running job, queued again if the job is cancelled
+	bool _jobRunning;
+	LodCamera _requestedCamera; // Camera and sample size last requested, requests repeating them are dropped
+	double _requestedSampleSize;
+	bool _rebuild; // The buffers don't hold the last mesh, the next request rebuilds it
+	std::atomic<size_t> _cancelEpoch; // Bumped to cancel the running job
+	std::atomic<GraphJobResult*> _mailbox; // Result of the finished job, posted by the job and taken by the render thread
+
+	// The running job owns the LOD state, the render thread only reads it once the job's result is taken
+	EquationProgram _lodEquation; // Equation the patches are evaluated with
+	SurfaceQuadtree _quadtree;
+	std::unordered_map<uint64_t, Patch> _patches; // By PatchId::Key, evaluated at _patchSampleSize and reused while in use
+	double _patchSampleSize;
+	size_t _lodUpdates;
+	bool _meshStale; // The patches changed since the last mesh was built
+	// Only heights and slopes are stored per vertex, x and z follow from the vertex's slot in _patchTexture
+	StreamBuffer _bufferGraphHeights;
+	StreamBuffer _bufferGraphSlopes;
+	GLuint _vertexArray;
+	bool _attributesStale; // The buffers' drawn contents moved since the vertex array was pointed at them
+	GLuint _patchBuffer;
+	GLuint _patchTexture;
+	bool _quantized;
+	GLfloat _heightScale, _heightBias;
+	vector<Slot> _slots; // Patches that are drawn, in the first slots of the buffers
+	size_t _slotCapacity; // Slots the vertex buffers have room for
+	// Line strips of the outlines along z (at fixed x), then along x, over the surface vertices and cut by restart_index
+	GLuint _outlineBuffer;
+	GLenum _outlineIndexType;
+	size_t _outlineIndicesZ;
+	size_t _outlineIndicesX;
+	GLuint _heightfieldProgram;
 };
 
+// Triangle strips over a square of "quads" x "quads" quads, "stride" vertices a row from "base", cut by restart_index
+void AppendGridStrips(vector<GLuint>& indices, GLuint base, size_t stride, size_t quads, size_t tile);
+
 class GraphEditor;
 
 class GraphManager
 {
 public:
 	GraphManager(GLuint program, vector<pair<string, void*>>* windowVars = nullptr);
+	~GraphManager();
 
 	size_t NewGraph(string equation = "0");
 	size_t RemoveGraph(size_t graphId);
-	void UpdateEquation(size_t graphId, string equation);
-	void generateIndecies();
+	// Compiles the equation and generates the graph with it in the background, the editor's diagnostic is set once done
+	void UpdateEquation(size_t graphId, string_view equation);
+	const EquationProgram& GetEquation(size_t graphId);
+	bool SetNativeEquations(bool native);
+	bool SetGpuEquations(bool gpu);
+	// Stores the heights of graphs generated on the CPU as 16 bit values instead of floats
+	void SetQuantizedHeights(bool quantized);
+	// Threads generating the graphs, including the render thread
+	void SetThreadCount(size_t threadCount);
+	size_t GetThreadCount() const { return _threadPool->ThreadCount(); };
+	// Samples of the graphs a side are graph_sides * sampleCount * resolution, as long as the memory budget allows
+	// Graphs evaluated on the GPU draw outlines every "resolution" samples, with up to grid_tile_quads of them
+	void SetGridSize(size_t sampleCount, size_t resolution);
+	// Bytes the mesh of each graph generated on the CPU may take, see Graph::patch_bytes
+	void SetMemoryBudget(size_t bytes);
+	size_t GetMemoryBudget() const { return _memoryBudget; };
+	// Patches each graph is drawn with at most, following from the grid size and the memory budget
+	size_t MaxPatches() const;
+	// Writes the surface of a shown graph over the drawn square to "path", "resolution" quads a side, the drawn grid's
+	// with 0. Blocks until the file is written, see ExportMesh
+	MeshExportResult ExportGraph(size_t graphId, const string& path, meshFormats format, size_t resolution = 0);
+	// Camera the main program draws with, "perspective" row major as main.cpp uploads it, and the framebuffer's height
+	// Set along with the main program's uniforms before every Draw, the graphs are drawn and refined for it
+	void SetCamera(const GLfloat perspective[16], const GLfloat offset[3], const GLfloat angle[2], int viewportHeight);
+	// A graph's job finished, the next Draw shows its result. Render thread only
+	bool HasJobResults() const;
+	// Graphs are being generated, their results can come in without any input. Render thread only
+	bool JobsRunning() const;
 	void Draw();
 
 	bool _focused;
 
 private:
-	vector<Graph> _graphs;
+	void updateGraphs(const vector<Graph*>& graphs);
+	void startJobs();
+	void takeJobResults();
+	GraphRequest lodRequest() const;
+	void buildGrid();
+	size_t gridResolution() const;
+	void buildPatchIndices(size_t slots);
+	void updateView();
+	void updateGridTiles();
+	LodCamera lodCamera() const;
+
+	std::deque<Graph> _graphs; // Jobs hold on to their graph, so graphs never move
 	vector<GraphEditor> _graphEditors;
-	vector<pair<char, double>> _vars; // x,z,...
+	vector<char> _varNames; // x,z,...
 	size_t _sampleCount;
 	size_t _resolution;
+	size_t _memoryBudget;
 	double* _graphZoom; // The graph zoom is ideally global for all graphs
 	double _curGraphZoom; // for forcing graph updates, might make an array of forced varaibles if needed
-	GLuint* _indexBuff;
 	size_t _curId;
 	GLuint _program;
+	// Camera set by SetCamera, in the std140 layout of the GraphView block
+	struct
+	{
+		GLfloat perspective[16]; // Column major
+		GLfloat offset[3];
+		GLfloat padding;
+		GLfloat angle[2];
+		GLfloat end[2];
+	} _view;
+	int _viewportHeight;
+	GLuint _vertexArray; // Bound by main.cpp for the axes, restored after drawing the graphs
+	GLuint _heightfieldProgram; // Draws the graphs generated on the CPU
+	GraphUniforms _heightfieldUniforms;
+	GLuint _viewBuffer; // GraphView block of the graph programs
+	ViewFrustum _frustum; // Of the camera in _viewBuffer
+	GLuint _styleBuffer; // GraphStyle blocks of the drawn graphs, _styleStride bytes apart
+	size_t _styleStride;
+	bool _nativeEquations;
+	bool _gpuEquations;
+	bool _quantizedHeights;
+	GraphGrid _grid;
+	PatchIndices _patchIndices;
+	TaskGroup _jobs; // Background jobs of all graphs
+	unique_ptr<ThreadPool> _threadPool;
+
+	constexpr static size_t default_memory_budget = 256 << 20;
+	// Tiles of the GPU grid are as many drawn units a side as fit grid_tile_quads quads, in a power of two, so the grid's
+	// resolution is at most grid_tile_quads
+	constexpr static size_t grid_tile_quads = 64;
 };
 
 
@@ -96,6 +369,7 @@ public:
 	GraphEditor(size_t graphId, GraphManager* graphManager, string equation = "");
 	void Draw();
 	int TextEditCallback(ImGuiInputTextCallbackData* data);
+	void SetDiagnostic(const EquationDiagnostic& diagnostic) { _diagnostic = diagnostic; };
 	
 
 	size_t id;
@@ -104,6 +378,7 @@ public:
 private:
 	bool _open;
 	string _equation;
+	EquationDiagnostic _diagnostic; // Error in the last edit of the equation, if any
 	GraphManager* _graphManager;
 };
 
@@ -0,0 +1,385 @@
+#include "bytecode.h"
+#include "simd.h"
+#include "jit.h"
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <map>
+#include <tuple>
+
+/*
+A unique value of the equation. Structurally identical subtrees map to the same value,
+which turns the tree into a DAG where every shared subexpression is computed once
+*/
+struct DagValue
+{
+	unsigned int op;
+	unsigned int a, b; // operand values
+	double value; // OP_CONST value
+	size_t var; // OP_VAR index
+};
+
+class DagBuilder
+{
+public:
+	DagBuilder(const EquationTree& tree) : _tree(tree), _added(tree.ArenaSize(), noNode) {};
+
+	unsigned int Add(nodeIndex index)
+	{
+		// Nodes shared in the tree are only looked up once
+		if (_added[index] != noNode) return _added[index];
+
+		const EquationNode& node = _tree.Node(index);
+		DagValue v = { (unsigned int)node._op, 0, 0, node._value, node._var };
+		if (node._left != noNode) v.a = Add(node._left);
+		if (node._right != noNode) v.b = Add(node._right);
+
+		// x*z and z*x are the same value
+		if ((v.op == OP_ADD || v.op == OP_MUL) && v.a > v.b) std::swap(v.a, v.b);
+
+		// Constants are keyed by their bits, NaN would break the ordering of the map otherwise
+		unsigned long long bits = 0;
+		if (v.op == OP_CONST) memcpy(&bits, &v.value, sizeof(bits));
+		else if (v.op == OP_VAR) bits = v.var;
+
+		auto key = std::make_tuple(v.op, v.a, v.b, bits);
+		auto found = _ids.find(key);
+		if (found != _ids.end()) return _added[index] = found->second;
+
+		unsigned int id = (unsigned int)values.size();
+		values.push_back(v);
+		_ids[key] = id;
+		return _added[index] = id;
+	}
+
+	vector<DagValue> values; // In topological order, operands always come before their users
+
+private:
+	const EquationTree& _tree;
+	vector<unsigned int> _added; // Value of every tree node, noNode until added
+	std::map<std::tuple<unsigned int, unsigned int, unsigned int, unsigned long long>, unsigned int> _ids;
+};
+
+static bool isBinary(unsigned int op)
+{
+	return op >= OP_ADD && op <= OP_POW;
+}
+
+template <typename Func>
+static void mapLanes(double* dst, const double* a, size_t count, Func func)
+{
+	for (size_t i = 0; i < count; i++) dst[i] = func(a[i]);
+}
+
+/*
+Applies the chain rule across a block of dual registers, with "lanes" values per row. "func" returns the value of a lane and
+sets the derivatives of the value by the operands. dst may be one of the operands, so all of a lane's
+operands are read before any of its results are written
+*/
+template <bool binary, typename Func>
+static void dualLanes(double* dst, const double* a, const double* b, size_t count, size_t rows, size_t lanes, Func func)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		double da = 0, db = 0;
+		double value = func(a[i], b[i], da, db);
+		for (size_t k = 1; k < rows; k++)
+		{
+			double d = da * a[k * lanes + i];
+			// Constant operands (e.g. exponents) contribute nothing, skipping them avoids 0 * inf for log of negative bases
+			if (binary && b[k * lanes + i] != 0) d += db * b[k * lanes + i];
+			dst[k * lanes + i] = d;
+		}
+		dst[i] = value;
+	}
+}
+
+EquationProgram CompileEquation(const EquationTree& tree, const vector<char>& varNames)
+{
+	static std::atomic<size_t> lastProgramId(0);
+
+	EquationProgram program;
+	program._id = ++lastProgramId;
+	program._varNames = varNames;
+
+	DagBuilder dag(tree);
+	unsigned int rootValue = dag.Add(tree.Root());
+	const vector<DagValue>& values = dag.values;
+	program._sourceNodeCount = CountEquationNodes(tree);
+	program._nodeCount = values.size();
+
+	// Register layout: [variables][constants][temporaries]
+	unsigned int constBase = (unsigned int)varNames.size();
+	unsigned int tempBase = constBase + (unsigned int)std::count_if(values.begin(), values.end(), [](const DagValue& v) { return v.op == OP_CONST; });
+
+	// A temporary register can be reused once the last instruction reading it has run
+	vector<unsigned int> lastUse(values.size(), 0);
+	for (unsigned int i = 0; i < values.size(); i++)
+	{
+		if (values[i].op == OP_CONST || values[i].op == OP_VAR) continue;
+		lastUse[values[i].a] = i;
+		if (isBinary(values[i].op)) lastUse[values[i].b] = i;
+	}
+	lastUse[rootValue] = (unsigned int)values.size();
+
+	vector<unsigned int> registers(values.size());
+	vector<unsigned int> freeRegisters;
+	unsigned int nextRegister = tempBase;
+	for (unsigned int i = 0; i < values.size(); i++)
+	{
+		const DagValue& v = values[i];
+		if (v.op == OP_CONST)
+		{
+			registers[i] = constBase + (unsigned int)program._constants.size();
+			program._constants.push_back(v.value);
+			continue;
+		}
+		if (v.op == OP_VAR)
+		{
+			registers[i] = (unsigned int)v.var;
+			continue;
+		}
+
+		Instruction ins = { v.op, 0, registers[v.a], isBinary(v.op) ? registers[v.b] : 0 };
+
+		// Operands read for the last time hand their register over to the result
+		if (lastUse[v.a] == i && ins.a >= tempBase) freeRegisters.push_back(ins.a);
+		if (isBinary(v.op) && v.b != v.a && lastUse[v.b] == i && ins.b >= tempBase) freeRegisters.push_back(ins.b);
+
+		if (freeRegisters.empty())
+		{
+			ins.dst = nextRegister++;
+		}
+		else
+		{
+			ins.dst = freeRegisters.back();
+			freeRegisters.pop_back();
+		}
+		registers[i] = ins.dst;
+		program._code.push_back(ins);
+	}
+	program._result = registers[rootValue];
+	program._registerCount = nextRegister;
+	return program;
+}
+
+/*
+Sizes the frame's registers for this program, constants are loaded once here and
+evaluation only ever writes the variable and temporary registers
+*/
+void EquationProgram::prepareFrame(EvaluationFrame& frame) const
+{
+	if (frame._programId == _id) return;
+
+	size_t constBase = _varNames.size();
+	frame._registers.assign(_registerCount, 0);
+	std::copy(_constants.begin(), _constants.end(), frame._registers.begin() + constBase);
+	frame._batchRegisters.assign(_registerCount * batchLanes, 0);
+	for (size_t i = 0; i < _constants.size(); i++)
+	{
+		std::fill_n(frame._batchRegisters.begin() + (constBase + i) * batchLanes, batchLanes, _constants[i]);
+	}
+	frame._programId = _id;
+}
+
+double EquationProgram::Evaluate(const double* varValues, EvaluationFrame& frame) const
+{
+	prepareFrame(frame);
+	double* r = frame._registers.data();
+	std::copy(varValues, varValues + _varNames.size(), r);
+
+	const Instruction* end = _code.data() + _code.size();
+	for (const Instruction* pc = _code.data(); pc != end; pc++)
+	{
+		const Instruction& ins = *pc;
+		switch (ins.op)
+		{
+		case OP_ADD: r[ins.dst] = r[ins.a] + r[ins.b]; break;
+		case OP_SUB: r[ins.dst] = r[ins.a] - r[ins.b]; break;
+		case OP_MUL: r[ins.dst] = r[ins.a] * r[ins.b]; break;
+		case OP_DIV: r[ins.dst] = r[ins.a] / r[ins.b]; break;
+		case OP_POW: r[ins.dst] = pow(r[ins.a], r[ins.b]); break;
+		case OP_COS: r[ins.dst] = cos(r[ins.a]); break;
+		case OP_SIN: r[ins.dst] = sin(r[ins.a]); break;
+		case OP_TAN: r[ins.dst] = tan(r[ins.a]); break;
+		case OP_ACOS: r[ins.dst] = acos(r[ins.a]); break;
+		case OP_ASIN: r[ins.dst] = asin(r[ins.a]); break;
+		case OP_ATAN: r[ins.dst] = atan(r[ins.a]); break;
+		case OP_LOG: r[ins.dst] = log(r[ins.a]); break;
+		}
+	}
+	return r[_result];
+}
+
+/*
+Runs every instruction across a block of samples before moving to the next instruction, so the dispatch
+cost is paid once per block and arithmetic runs through the widest SIMD kernels the CPU supports
+*/
+void EquationProgram::EvaluateBatch(const double* const* varValues, double* out, size_t count, EvaluationFrame& frame) const
+{
+	if (_native)
+	{
+		_native->Function()(varValues, out, count);
+		return;
+	}
+
+	prepareFrame(frame);
+	const BatchKernels& kernels = GetBatchKernels();
+	double* r = frame._batchRegisters.data();
+	const Instruction* end = _code.data() + _code.size();
+
+	for (size_t start = 0; start < count; start += batchLanes)
+	{
+		size_t n = std::min(batchLanes, count - start);
+		for (size_t i = 0; i < _varNames.size(); i++)
+		{
+			std::copy(varValues[i] + start, varValues[i] + start + n, r + i * batchLanes);
+		}
+
+		for (const Instruction* pc = _code.data(); pc != end; pc++)
+		{
+			double* dst = r + pc->dst * batchLanes;
+			const double* a = r + pc->a * batchLanes;
+			const double* b = r + pc->b * batchLanes;
+			switch (pc->op)
+			{
+			case OP_ADD: kernels.add(dst, a, b, n); break;
+			case OP_SUB: kernels.sub(dst, a, b, n); break;
+			case OP_MUL: kernels.mul(dst, a, b, n); break;
+			case OP_DIV: kernels.div(dst, a, b, n); break;
+			case OP_POW: for (size_t i = 0; i < n; i++) dst[i] = pow(a[i], b[i]); break;
+			case OP_COS: mapLanes(dst, a, n, [](double v) { return cos(v); }); break;
+			case OP_SIN: mapLanes(dst, a, n, [](double v) { return sin(v); }); break;
+			case OP_TAN: mapLanes(dst, a, n, [](double v) { return tan(v); }); break;
+			case OP_ACOS: mapLanes(dst, a, n, [](double v) { return acos(v); }); break;
+			case OP_ASIN: mapLanes(dst, a, n, [](double v) { return asin(v); }); break;
+			case OP_ATAN: mapLanes(dst, a, n, [](double v) { return atan(v); }); break;
+			case OP_LOG: mapLanes(dst, a, n, [](double v) { return log(v); }); break;
+			}
+		}
+
+		const double* result = r + _result * batchLanes;
+		std::copy(result, result + n, out + start);
+	}
+}
+
+void EquationProgram::prepareDualFrame(EvaluationFrame& frame) const
+{
+	if (frame._dualProgramId == _id) return;
+
+	// Constants have no derivative, the variables' own derivatives are seeded once per block
+	size_t rows = 1 + _varNames.size();
+	size_t constBase = _varNames.size();
+	frame._dualRegisters.assign(_registerCount * rows * batchLanes, 0);
+	for (size_t i = 0; i < _constants.size(); i++)
+	{
+		std::fill_n(frame._dualRegisters.begin() + (constBase + i) * rows * batchLanes, batchLanes, _constants[i]);
+	}
+	frame._dualProgramId = _id;
+}
+
+/*
+Every register holds a value row followed by one derivative row per variable, each instruction applies
+the chain rule on top of computing its value
+*/
+void EquationProgram::EvaluateDerivativesBatch(const double* const* varValues, double* out, double* const* derivatives, size_t count, EvaluationFrame& frame) const
+{
+	prepareDualFrame(frame);
+	const size_t varCount = _varNames.size();
+	const size_t rows = 1 + varCount;
+	const size_t stride = rows * batchLanes; // Distance between registers
+	double* r = frame._dualRegisters.data();
+	const Instruction* end = _code.data() + _code.size();
+
+	for (size_t start = 0; start < count; start += batchLanes)
+	{
+		size_t n = std::min(batchLanes, count - start);
+		for (size_t i = 0; i < varCount; i++)
+		{
+			std::copy(varValues[i] + start, varValues[i] + start + n, r + i * stride);
+			// d var_i / d var_k
+			for (size_t k = 0; k < varCount; k++)
+				std::fill_n(r + i * stride + (1 + k) * batchLanes, batchLanes, i == k ? 1.0 : 0.0);
+		}
+
+		for (const Instruction* pc = _code.data(); pc != end; pc++)
+		{
+			double* dst = r + pc->dst * stride;
+			const double* a = r + pc->a * stride;
+			const double* b = r + pc->b * stride;
+			// Each operation gives its value and the derivatives of the value by its operands
+			switch (pc->op)
+			{
+			case OP_ADD: dualLanes<true>(dst, a, b, n, rows, batchLanes, [](double va, double vb, double& da, double& db) { da = 1; db = 1; return va + vb; }); break;
+			case OP_SUB: dualLanes<true>(dst, a, b, n, rows, batchLanes, [](double va, double vb, double& da, double& db) { da = 1; db = -1; return va - vb; }); break;
+			case OP_MUL: dualLanes<true>(dst, a, b, n, rows, batchLanes, [](double va, double vb, double& da, double& db) { da = vb; db = va; return va * vb; }); break;
+			case OP_DIV: dualLanes<true>(dst, a, b, n, rows, batchLanes, [](double va, double vb, double& da, double& db) { da = 1 / vb; db = -(va / vb) / vb; return va / vb; }); break;
+			case OP_POW: dualLanes<true>(dst, a, b, n, rows, batchLanes, [](double va, double vb, double& da, double& db) { double v = pow(va, vb); da = vb * pow(va, vb - 1); db = v * log(va); return v; }); break;
+			case OP_COS: dualLanes<false>(dst, a, b, n, rows, batchLanes, [](double va, double, double& da, double&) { da = -sin(va); return cos(va); }); break;
+			case OP_SIN: dualLanes<false>(dst, a, b, n, rows, batchLanes, [](double va, double, double& da, double&) { da = cos(va); return sin(va); }); break;
+			case OP_TAN: dualLanes<false>(dst, a, b, n, rows, batchLanes, [](double va, double, double& da, double&) { double v = tan(va); da = 1 + v * v; return v; }); break;
+			case OP_ACOS: dualLanes<false>(dst, a, b, n, rows, batchLanes, [](double va, double, double& da, double&) { da = -1 / sqrt(1 - va * va); return acos(va); }); break;
+			case OP_ASIN: dualLanes<false>(dst, a, b, n, rows, batchLanes, [](double va, double, double& da, double&) { da = 1 / sqrt(1 - va * va); return asin(va); }); break;
+			case OP_ATAN: dualLanes<false>(dst, a, b, n, rows, batchLanes, [](double va, double, double& da, double&) { da = 1 / (1 + va * va); return atan(va); }); break;
+			case OP_LOG: dualLanes<false>(dst, a, b, n, rows, batchLanes, [](double va, double, double& da, double&) { da = 1 / va; return log(va); }); break;
+			}
+		}
+
+		const double* result = r + _result * stride;
+		std::copy(result, result + n, out + start);
+		for (size_t k = 0; k < varCount; k++)
+		{
+			std::copy(result + (1 + k) * batchLanes, result + (1 + k) * batchLanes + n, derivatives[k] + start);
+		}
+	}
+}
+
+Interval EquationProgram::EvaluateInterval(const Interval* varRanges, EvaluationFrame& frame) const
+{
+	if (frame._intervalProgramId != _id)
+	{
+		frame._intervalRegisters.assign(_registerCount, Interval());
+		for (size_t i = 0; i < _constants.size(); i++)
+		{
+			frame._intervalRegisters[_varNames.size() + i] = Interval::Point(_constants[i]);
+		}
+		frame._intervalProgramId = _id;
+	}
+
+	Interval* r = frame._intervalRegisters.data();
+	std::copy(varRanges, varRanges + _varNames.size(), r);
+	for (const Instruction& ins : _code)
+	{
+		// Simplification turns x^2 into x*x, bounded as a square it can't go negative like the product of two ranges can
+		if (ins.op == OP_MUL && ins.a == ins.b) r[ins.dst] = EvaluateIntervalOperation(OP_POW, r[ins.a], Interval::Point(2));
+		else r[ins.dst] = EvaluateIntervalOperation(ins.op, r[ins.a], r[ins.b]);
+	}
+	return r[_result];
+}
+
+/*
+Compiles the program to native code, leaving the interpreter in use if that isn't possible on this system
+*/
+bool EquationProgram::CompileNative()
+{
+	shared_ptr<NativeEquation> native = std::make_shared<NativeEquation>(*this);
+	if (native->Function() == nullptr) return false;
+	_native = native;
+	return true;
+}
+
+void EquationProgram::ReleaseNative()
+{
+	_native = nullptr;
+}
+
+int EquationProgram::VariableIndex(char name) const
+{
+	for (size_t i = 0; i < _varNames.size(); i++)
+	{
+		if (toupper(_varNames[i]) == toupper(name)) return (int)i;
+	}
+	return -1;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <memory>
+
+#include "parsing.h"
+#include "interval.h"
+
+using std::vector;
+using std::pair;
+using std::shared_ptr;
+
+class NativeEquation;
+class EquationProgram;
+
+/*
+A single register machine instruction: registers[dst] = op(registers[a], registers[b])
+Registers are laid out as [variables][constants][temporaries], only operations emit instructions
+*/
+struct Instruction
+{
+	unsigned int op;
+	unsigned int dst;
+	unsigned int a;
+	unsigned int b;
+};
+
+/*
+Scratch registers for evaluating an equation program. Programs themselves are never written to during
+evaluation, so any number of threads can evaluate the same program at once, each with its own frame
+A frame can be reused across programs, it is reinitialized whenever it is used with a different one
+*/
+class EvaluationFrame
+{
+public:
+	EvaluationFrame() = default;
+
+private:
+	friend class EquationProgram;
+
+	size_t _programId = 0;
+	vector<double> _registers;
+	vector<double> _batchRegisters; // registerCount rows of batchLanes values
+	size_t _dualProgramId = 0;
+	vector<double> _dualRegisters; // registerCount blocks of (1 + variableCount) rows of batchLanes values
+	size_t _intervalProgramId = 0;
+	vector<Interval> _intervalRegisters;
+};
+
+/*
+Flat form of an equation tree: a contiguous instruction array and a constant pool, with identical subtrees merged,
+evaluated by a single loop with no recursion and no indirect calls per node
+*/
+class EquationProgram
+{
+public:
+	EquationProgram() = default;
+
+	// varValues holds one value per variable, in the order of the variable list the program was compiled with
+	double Evaluate(const double* varValues, EvaluationFrame& frame) const;
+	// Evaluates "count" samples at once, varValues holds one array of "count" values per variable
+	// Runs natively compiled code when CompileNative() succeeded, the interpreter otherwise
+	void EvaluateBatch(const double* const* varValues, double* out, size_t count, EvaluationFrame& frame) const;
+	// Same as EvaluateBatch, also computing the partial derivatives by every variable in the same pass (forward mode
+	// automatic differentiation), derivatives holds one array of "count" values per variable. Always interpreted
+	void EvaluateDerivativesBatch(const double* const* varValues, double* out, double* const* derivatives, size_t count, EvaluationFrame& frame) const;
+	// Bounds the equation over the given range of every variable
+	Interval EvaluateInterval(const Interval* varRanges, EvaluationFrame& frame) const;
+
+	bool CompileNative();
+	void ReleaseNative();
+	bool IsNative() const { return _native != nullptr; };
+
+	int VariableIndex(char name) const;
+	size_t VariableCount() const { return _varNames.size(); };
+	size_t InstructionCount() const { return _code.size(); };
+	size_t RegisterCount() const { return _registerCount; };
+	// Node count of the source tree, and of the program after merging identical subtrees
+	size_t SourceNodeCount() const { return _sourceNodeCount; };
+	size_t NodeCount() const { return _nodeCount; };
+
+	// Unique per compiled program, copies share it
+	size_t Id() const { return _id; };
+	const vector<Instruction>& Code() const { return _code; };
+	const vector<double>& Constants() const { return _constants; };
+	unsigned int ResultRegister() const { return _result; };
+
+	friend EquationProgram CompileEquation(const EquationTree& tree, const vector<char>& varNames);
+
+private:
+	void prepareFrame(EvaluationFrame& frame) const;
+	void prepareDualFrame(EvaluationFrame& frame) const;
+
+	size_t _id = 0; // Unique per compiled program, copies share it
+	vector<Instruction> _code;
+	vector<double> _constants;
+	vector<char> _varNames;
+	unsigned int _registerCount = 0;
+	unsigned int _result = 0;
+	size_t _sourceNodeCount = 0;
+	size_t _nodeCount = 0;
+	shared_ptr<NativeEquation> _native;
+
+	constexpr static size_t batchLanes = 64;
+};
+
+EquationProgram CompileEquation(const EquationTree& tree, const vector<char>& varNames);
@@ -1,4 +1,5 @@
 #include "Console.h"
+#include "profiler.h"
 #include "misc/cpp/imgui_stdlib.h"
 
 string upperString(string s)
@@ -20,6 +21,14 @@ Console::Console(GraphManager* gm) : _graphManager(gm)
 	_commands.push_back("CLEAR");
 	_commands.push_back("GRAPH");
 	_commands.push_back("REMOVE");
+	_commands.push_back("JIT");
+	_commands.push_back("GPU");
+	_commands.push_back("QUANTIZE");
+	_commands.push_back("THREADS");
+	_commands.push_back("PROFILE");
+	_commands.push_back("GRID");
+	_commands.push_back("BUDGET");
+	_commands.push_back("EXPORT");
 	_autoScroll = true;
 	_scrollToBottom = false;
 	_focused = false;
@@ -202,7 +211,10 @@ void Console::ExecCommand(string raw)
 		try
 		{
 			size_t id = _graphManager->NewGraph(args[0]);
+			const EquationProgram& equation = _graphManager->GetEquation(id);
 			_log.push_back("Generated graph with id: " + std::to_string(id)); 
+			_log.push_back("Equation nodes: " + std::to_string(equation.SourceNodeCount()) + ", " +
+				std::to_string(equation.NodeCount()) + " after merging shared subexpressions");
 		}
 		catch (EquationError err)
 		{
@@ -233,6 +245,39 @@ void Console::ExecCommand(string raw)
 			{
 				_log.push_back("remove [id]\nRemoves a graph with id [id]");
 			}
+			else if (cmdName == "JIT")
+			{
+				_log.push_back("jit [on/off]\nEvaluates graph equations with natively compiled code, requires a system C compiler");
+			}
+			else if (cmdName == "GPU")
+			{
+				_log.push_back("gpu [on/off]\nEvaluates graph equations on the GPU while drawing, zooming then regenerates nothing on the CPU");
+			}
+			else if (cmdName == "QUANTIZE")
+			{
+				_log.push_back("quantize [on/off]\nStores graph heights as 16 bit values scaled to each graph's range instead of floats");
+			}
+			else if (cmdName == "THREADS")
+			{
+				_log.push_back("threads [count]\nSets the number of threads generating graphs, shows the current count without [count]");
+			}
+			else if (cmdName == "PROFILE")
+			{
+				_log.push_back("profile [on/off]\nRecords CPU and GPU timings of the frames and shows them in a panel");
+				_log.push_back("profile export [file]\nWrites the recorded frames to [file] as a Chrome trace (chrome://tracing, Perfetto)");
+			}
+			else if (cmdName == "GRID")
+			{
+				_log.push_back("grid [count] [resolution]\nSets the sample grid of the graphs, 2 * [count] * [resolution] samples a side with outlines every [resolution] samples, as far as the memory budget allows. Graphs on the GPU take up to 64 samples between outlines. Shows the current grid without arguments");
+			}
+			else if (cmdName == "BUDGET")
+			{
+				_log.push_back("budget [megabytes]\nSets the memory the mesh of each graph generated on the CPU may take, shows the current budget without [megabytes]");
+			}
+			else if (cmdName == "EXPORT")
+			{
+				_log.push_back("export [id] [file] [format] [resolution]\nWrites the surface of graph [id] over the drawn area to [file] as binary STL, PLY or GLB, by [format] or else the file's extension, with [resolution] quads a side or the drawn grid's");
+			}
 			else
 			{
 				_log.push_back("Unrecognized command/No Description exists");
@@ -254,6 +299,166 @@ void Console::ExecCommand(string raw)
 		size_t id = stoi(args[0]);
 		size_t result = _graphManager->RemoveGraph(id);
 	}
+	else if (cmd == "JIT")
+	{
+		string state = cargs == 1 ? upperString(args[0]) : "";
+		if (state != "ON" && state != "OFF")
+		{
+			_log.push_back("Invalid usage, try: jit [on/off]");
+			return;
+		}
+
+		if (_graphManager->SetNativeEquations(state == "ON"))
+			_log.push_back(state == "ON" ? "Equations now run as native code" : "Equations now run on the interpreter");
+		else
+			_log.push_back("[error] Native code isn't available, equations still run on the interpreter");
+	}
+	else if (cmd == "GPU")
+	{
+		string state = cargs == 1 ? upperString(args[0]) : "";
+		if (state != "ON" && state != "OFF")
+		{
+			_log.push_back("Invalid usage, try: gpu [on/off]");
+			return;
+		}
+
+		if (_graphManager->SetGpuEquations(state == "ON"))
+			_log.push_back(state == "ON" ? "Equations now run on the GPU" : "Equations now run on the CPU");
+		else
+			_log.push_back("[error] Some equations failed to compile for the GPU, those graphs still run on the CPU");
+	}
+	else if (cmd == "QUANTIZE")
+	{
+		string state = cargs == 1 ? upperString(args[0]) : "";
+		if (state != "ON" && state != "OFF")
+		{
+			_log.push_back("Invalid usage, try: quantize [on/off]");
+			return;
+		}
+
+		_graphManager->SetQuantizedHeights(state == "ON");
+		_log.push_back(state == "ON" ? "Graph heights now stored as 16 bit values" : "Graph heights now stored as floats");
+	}
+	else if (cmd == "THREADS")
+	{
+		if (cargs > 1)
+		{
+			_log.push_back("Invalid usage, try: threads [count]");
+			return;
+		}
+
+		if (cargs == 1)
+		{
+			int count = atoi(args[0].c_str());
+			if (count < 1)
+			{
+				_log.push_back("[error] Thread count must be a positive number");
+				return;
+			}
+			_graphManager->SetThreadCount(count);
+		}
+		_log.push_back("Generating graphs with " + std::to_string(_graphManager->GetThreadCount()) + " threads");
+	}
+	else if (cmd == "PROFILE")
+	{
+		string action = cargs >= 1 ? upperString(args[0]) : "";
+		if (action == "EXPORT" && cargs == 2)
+		{
+			if (Profiler::ExportTrace(args[1]))
+				_log.push_back("Trace of the last " + std::to_string(Profiler::history_frames) + " frames written to " + args[1]);
+			else
+				_log.push_back("[error] Couldn't write " + args[1]);
+		}
+		else if ((action == "ON" || action == "OFF") && cargs == 1)
+		{
+			Profiler::SetEnabled(action == "ON");
+			_log.push_back(action == "ON" ? "Profiling frames" : "Stopped profiling, the recorded frames can still be exported");
+		}
+		else
+		{
+			_log.push_back("Invalid usage, try: profile [on/off], profile export [file]");
+		}
+	}
+	else if (cmd == "GRID")
+	{
+		if (cargs != 0 && cargs != 2)
+		{
+			_log.push_back("Invalid usage, try: grid [count] [resolution]");
+			return;
+		}
+
+		if (cargs == 2)
+		{
+			long long count = atoll(args[0].c_str()), resolution = atoll(args[1].c_str());
+			if (count < 1 || resolution < 1)
+			{
+				_log.push_back("[error] Count and resolution must be positive numbers");
+				return;
+			}
+			_graphManager->SetGridSize(count, resolution);
+		}
+		_log.push_back("Graphs drawn with up to " + std::to_string(_graphManager->MaxPatches()) + " patches of " +
+			std::to_string(Graph::patch_vertices) + " samples");
+	}
+	else if (cmd == "BUDGET")
+	{
+		if (cargs > 1)
+		{
+			_log.push_back("Invalid usage, try: budget [megabytes]");
+			return;
+		}
+
+		if (cargs == 1)
+		{
+			long long megabytes = atoll(args[0].c_str());
+			if (megabytes < 1)
+			{
+				_log.push_back("[error] The budget must be a positive number of megabytes");
+				return;
+			}
+			_graphManager->SetMemoryBudget((size_t)megabytes << 20);
+		}
+		_log.push_back("Each graph's mesh may take " + std::to_string(_graphManager->GetMemoryBudget() >> 20) + " MB, " +
+			std::to_string(_graphManager->MaxPatches()) + " patches");
+	}
+	else if (cmd == "EXPORT")
+	{
+		if (cargs < 2 || cargs > 4)
+		{
+			_log.push_back("Invalid usage, try: export [graph id] [file] [stl/ply/glb] [resolution]");
+			return;
+		}
+
+		// Without a format the file's extension picks it, STL if it has none
+		meshFormats format = MESH_STL;
+		size_t dot = args[1].find_last_of('.');
+		bool extension = dot != string::npos && args[1].find_first_of("/\\", dot) == string::npos;
+		string formatName = cargs >= 3 ? args[2] : extension ? args[1].substr(dot) : "";
+		if (!formatName.empty() && !MeshFormatFromName(formatName, format))
+		{
+			_log.push_back("[error] Can't export as " + formatName + ", try stl, ply or glb (glTF is written as binary .glb)");
+			return;
+		}
+
+		long long resolution = cargs == 4 ? atoll(args[3].c_str()) : 0;
+		if (cargs == 4 && resolution < 1)
+		{
+			_log.push_back("[error] Resolution must be a positive number");
+			return;
+		}
+
+		MeshExportResult result = _graphManager->ExportGraph(atoll(args[0].c_str()), args[1], format, (size_t)resolution);
+		if (!result.success)
+		{
+			_log.push_back("[error] " + result.error);
+			return;
+		}
+		char summary[256];
+		double megabytes = result.bytes / (double)(1 << 20);
+		snprintf(summary, sizeof(summary), "Wrote %zu triangles to %s, %.1f MB in %.2f s (%.1f MB/s)", result.triangles,
+			args[1].c_str(), megabytes, result.seconds, result.seconds > 0 ? megabytes / result.seconds : 0);
+		_log.push_back(summary);
+	}
 	else
 	{
 		_log.push_back("Not implemented");
@@ -0,0 +1,155 @@
+#include "gpuequation.h"
+#include <cstdio>
+#include <cmath>
+#include <cfloat>
+
+#include "shaders.h"
+
+static string registerName(unsigned int reg)
+{
+	return "r" + std::to_string(reg);
+}
+
+// Nearest single precision GLSL literal for a constant
+static string constantLiteral(double value)
+{
+	if (std::isnan(value)) return "eq_nan()";
+	if (std::abs(value) > FLT_MAX) return value > 0 ? "eq_inf()" : "-eq_inf()";
+
+	char literal[64];
+	snprintf(literal, sizeof(literal), "%.9g", value);
+	string result = literal;
+	if (result.find_first_of(".e") == string::npos) result += ".0";
+	return result;
+}
+
+static string instructionExpression(const Instruction& ins)
+{
+	string a = registerName(ins.a);
+	string b = registerName(ins.b);
+	switch (ins.op)
+	{
+	case OP_ADD: return "eq_add(" + a + ", " + b + ")";
+	case OP_SUB: return "eq_sub(" + a + ", " + b + ")";
+	case OP_MUL: return "eq_mul(" + a + ", " + b + ")";
+	case OP_DIV: return "eq_div(" + a + ", " + b + ")";
+	case OP_POW: return "eq_pow(" + a + ", " + b + ")";
+	case OP_COS: return "eq_cos(" + a + ")";
+	case OP_SIN: return "eq_sin(" + a + ")";
+	case OP_TAN: return "eq_tan(" + a + ")";
+	case OP_ACOS: return "eq_acos(" + a + ")";
+	case OP_ASIN: return "eq_asin(" + a + ")";
+	case OP_ATAN: return "eq_atan(" + a + ")";
+	case OP_LOG: return "eq_log(" + a + ")";
+	}
+	return a;
+}
+
+/*
+Translates the program into a GLSL function, one vec3 local per register holding its value and its derivatives by x and z
+Variables other than x and z take the value of x, as on the CPU
+*/
+string GenerateEquationGLSL(const EquationProgram& program, const char* functionName)
+{
+	unsigned int constBase = (unsigned int)program.VariableCount();
+	unsigned int tempBase = constBase + (unsigned int)program.Constants().size();
+	int xIndex = program.VariableIndex('x');
+	int zIndex = program.VariableIndex('z');
+
+	string source = string("vec3 ") + functionName + "(float x, float z)\n{\n";
+	for (unsigned int i = 0; i < constBase; i++)
+	{
+		string value = "vec3(x, 0.0, 0.0)";
+		if ((int)i == xIndex) value = "vec3(x, 1.0, 0.0)";
+		else if ((int)i == zIndex) value = "vec3(z, 0.0, 1.0)";
+		source += "\tvec3 " + registerName(i) + " = " + value + ";\n";
+	}
+	for (unsigned int i = 0; i < program.Constants().size(); i++)
+	{
+		source += "\tvec3 " + registerName(constBase + i) + " = vec3(" + constantLiteral(program.Constants()[i]) + ", 0.0, 0.0);\n";
+	}
+	for (unsigned int i = tempBase; i < program.RegisterCount(); i++)
+	{
+		source += "\tvec3 " + registerName(i) + ";\n";
+	}
+
+	for (const Instruction& ins : program.Code())
+	{
+		source += "\t" + registerName(ins.dst) + " = " + instructionExpression(ins) + ";\n";
+	}
+
+	source += "\treturn " + registerName(program.ResultRegister()) + ";\n}\n";
+	return source;
+}
+
+static GLuint compileShader(GLenum type, const char* const* sources, GLsizei count)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, count, sources, 0);
+	glCompileShader(shader);
+
+	GLint compiled = GL_FALSE;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (compiled == GL_TRUE) return shader;
+
+	glDeleteShader(shader);
+	return 0;
+}
+
+GLuint LinkGraphProgram(const char* const* vertexSources, GLsizei count)
+{
+	GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertexSources, count);
+	GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, &fragment_shader, 1);
+
+	GLuint program = 0;
+	if (vertexShader != 0 && fragmentShader != 0)
+	{
+		program = glCreateProgram();
+		glAttachShader(program, vertexShader);
+		glAttachShader(program, fragmentShader);
+		glLinkProgram(program);
+
+		GLint linked = GL_FALSE;
+		glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		if (linked != GL_TRUE)
+		{
+			glDeleteProgram(program);
+			program = 0;
+		}
+		else
+		{
+			glUniformBlockBinding(program, glGetUniformBlockIndex(program, "GraphView"), GRAPH_VIEW_BINDING);
+			glUniformBlockBinding(program, glGetUniformBlockIndex(program, "GraphStyle"), GRAPH_STYLE_BINDING);
+		}
+	}
+
+	// The shaders are freed along with the program
+	if (vertexShader != 0) glDeleteShader(vertexShader);
+	if (fragmentShader != 0) glDeleteShader(fragmentShader);
+	return program;
+}
+
+GraphUniforms GetGraphUniforms(GLuint program)
+{
+	GraphUniforms uniforms;
+	uniforms.part = glGetUniformLocation(program, "part");
+	uniforms.isLit = glGetUniformLocation(program, "isLit");
+	uniforms.quantized = glGetUniformLocation(program, "quantized");
+	uniforms.heightScale = glGetUniformLocation(program, "heightScale");
+	uniforms.heightBias = glGetUniformLocation(program, "heightBias");
+	uniforms.sampleSize = glGetUniformLocation(program, "sampleSize");
+	return uniforms;
+}
+
+GpuEquation::GpuEquation(const EquationProgram& program)
+{
+	string function = GenerateEquationGLSL(program, "graph_equation");
+	const char* vertexSources[] = { equation_vertex_shader_head, function.c_str(), equation_vertex_shader_main };
+	_program = LinkGraphProgram(vertexSources, 3);
+	if (_program != 0) _uniforms = GetGraphUniforms(_program);
+}
+
+GpuEquation::~GpuEquation()
+{
+	if (_program != 0) glDeleteProgram(_program);
+}
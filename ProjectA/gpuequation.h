@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+
+#include <glew.h>
+
+#include "bytecode.h"
+
+using std::string;
+
+// Binding points of the uniform blocks of graph programs, see shaders.h
+enum graphBlockBindings
+{
+	GRAPH_VIEW_BINDING = 0, GRAPH_STYLE_BINDING = 1
+};
+
+// Colors of GraphStyle, the part of the graph a draw is of picks one
+enum graphParts
+{
+	PART_SURFACE = 0, PART_OUTLINE_Z = 1, PART_OUTLINE_X = 2
+};
+
+/*
+Locations of the uniforms graphs set per draw, looked up once per program. Those a program lacks are -1
+*/
+struct GraphUniforms
+{
+	GLint part = -1;
+	GLint isLit = -1;
+	GLint quantized = -1;
+	GLint heightScale = -1;
+	GLint heightBias = -1;
+	GLint sampleSize = -1;
+};
+
+/*
+Shader program drawing a graph with its equation evaluated on the GPU. The program is translated to a GLSL function
+spliced into the equation vertex shader (see shaders.h), which computes the heights and normals of a shared x/z grid
+Program() is 0 when the shaders failed to compile or link, callers then keep generating the graph on the CPU
+*/
+class GpuEquation
+{
+public:
+	explicit GpuEquation(const EquationProgram& program);
+	~GpuEquation();
+	GpuEquation(const GpuEquation&) = delete;
+	GpuEquation& operator=(const GpuEquation&) = delete;
+
+	GLuint Program() const { return _program; };
+	const GraphUniforms& Uniforms() const { return _uniforms; };
+
+private:
+	GLuint _program;
+	GraphUniforms _uniforms;
+};
+
+// Links a program from "vertexSources" and the fragment shader graphs are drawn with, with its uniform blocks bound to
+// graphBlockBindings. Returns 0 if that fails
+GLuint LinkGraphProgram(const char* const* vertexSources, GLsizei count);
+GraphUniforms GetGraphUniforms(GLuint program);
+// GLSL function "vec3 functionName(float x, float z)" computing the program and its derivatives in single precision
+string GenerateEquationGLSL(const EquationProgram& program, const char* functionName);
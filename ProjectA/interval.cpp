@@ -0,0 +1,154 @@
+#include "interval.h"
+#include "parsing.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <initializer_list>
+
+constexpr double infinity = std::numeric_limits<double>::infinity();
+constexpr double pi = 3.14159265358979323846;
+
+Interval Interval::Point(double value)
+{
+	Interval point;
+	point.lo = value;
+	point.hi = value;
+	point.empty = std::isnan(value);
+	return point;
+}
+
+static Interval bounds(double lo, double hi, bool maybeUndefined)
+{
+	Interval result;
+	// NaN bounds come from things like inf - inf, where the value itself might be undefined
+	if (std::isnan(lo) || std::isnan(hi))
+	{
+		result.lo = -infinity;
+		result.hi = infinity;
+		result.maybeUndefined = true;
+		return result;
+	}
+	result.lo = lo;
+	result.hi = hi;
+	result.maybeUndefined = maybeUndefined;
+	return result;
+}
+
+static Interval emptyInterval()
+{
+	Interval result;
+	result.empty = true;
+	return result;
+}
+
+// Smallest interval holding all of "values", for functions whose extremes are at the corners of their operands
+static Interval hull(std::initializer_list<double> values, bool maybeUndefined)
+{
+	double lo = infinity, hi = -infinity;
+	for (double value : values)
+	{
+		if (std::isnan(value)) return bounds(NAN, NAN, true);
+		lo = std::min(lo, value);
+		hi = std::max(hi, value);
+	}
+	return bounds(lo, hi, maybeUndefined);
+}
+
+// Whether phase + 2*pi*k lies in [lo, hi] for some integer k
+static bool containsPhase(double lo, double hi, double phase)
+{
+	return floor((hi - phase) / (2 * pi)) >= ceil((lo - phase) / (2 * pi));
+}
+
+// cos/sin over [lo, hi], "maxPhase" and "minPhase" are where the function reaches 1 and -1
+static Interval periodic(const Interval& a, double (*func)(double), double maxPhase, double minPhase)
+{
+	if (!std::isfinite(a.lo) || !std::isfinite(a.hi)) return bounds(-1, 1, true);
+	if (a.Width() >= 2 * pi) return bounds(-1, 1, a.maybeUndefined);
+
+	double endLo = func(a.lo), endHi = func(a.hi);
+	double lo = std::min(endLo, endHi);
+	double hi = std::max(endLo, endHi);
+	if (containsPhase(a.lo, a.hi, maxPhase)) hi = 1;
+	if (containsPhase(a.lo, a.hi, minPhase)) lo = -1;
+	return bounds(lo, hi, a.maybeUndefined);
+}
+
+static Interval power(const Interval& a, const Interval& b, bool maybeUndefined)
+{
+	// Integer exponent, defined for negative bases too
+	if (b.lo == b.hi && b.lo == floor(b.lo))
+	{
+		double n = b.lo;
+		if (n == 0) return bounds(1, 1, maybeUndefined);
+
+		double endLo = pow(a.lo, n), endHi = pow(a.hi, n);
+		bool even = fmod(n, 2) == 0;
+		if (!a.Contains(0)) return hull({ endLo, endHi }, maybeUndefined);
+		if (n > 0 && even) return bounds(0, std::max(endLo, endHi), maybeUndefined);
+		if (n > 0) return bounds(endLo, endHi, maybeUndefined);
+		if (even) return bounds(std::min(endLo, endHi), infinity, maybeUndefined);
+		return bounds(-infinity, infinity, maybeUndefined);
+	}
+
+	// For a non negative base, pow is monotonic in the base and in the exponent, so its extremes are at the corners
+	Interval base = a;
+	if (base.lo < 0)
+	{
+		// Negative bases are only defined for integer exponents
+		if (b.lo != b.hi) return bounds(-infinity, infinity, true);
+		if (base.hi < 0) return emptyInterval();
+		base.lo = 0;
+		maybeUndefined = true;
+	}
+	return hull({ pow(base.lo, b.lo), pow(base.lo, b.hi), pow(base.hi, b.lo), pow(base.hi, b.hi) }, maybeUndefined);
+}
+
+/*
+Interval version of every equation operation, undefined values (NaN) are tracked through maybeUndefined and empty
+*/
+Interval EvaluateIntervalOperation(unsigned int op, const Interval& a, const Interval& b)
+{
+	bool binary = op >= OP_ADD && op <= OP_POW;
+	if (a.empty || (binary && b.empty)) return emptyInterval();
+	bool maybeUndefined = a.maybeUndefined || (binary && b.maybeUndefined);
+
+	switch (op)
+	{
+	case OP_ADD: return bounds(a.lo + b.lo, a.hi + b.hi, maybeUndefined);
+	case OP_SUB: return bounds(a.lo - b.hi, a.hi - b.lo, maybeUndefined);
+	case OP_MUL: return hull({ a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi }, maybeUndefined);
+	case OP_DIV:
+	{
+		// Division by zero is infinite, or undefined for 0/0
+		if (b.Contains(0)) return bounds(-infinity, infinity, maybeUndefined || a.Contains(0));
+		return hull({ a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi }, maybeUndefined);
+	}
+	case OP_POW: return power(a, b, maybeUndefined);
+	case OP_COS: return periodic(a, cos, 0, pi);
+	case OP_SIN: return periodic(a, sin, pi / 2, -pi / 2);
+	case OP_TAN:
+	{
+		if (!std::isfinite(a.lo) || !std::isfinite(a.hi) || containsPhase(a.lo, a.hi, pi / 2) || containsPhase(a.lo, a.hi, -pi / 2))
+			return bounds(-infinity, infinity, maybeUndefined || !std::isfinite(a.lo) || !std::isfinite(a.hi));
+		return bounds(tan(a.lo), tan(a.hi), maybeUndefined);
+	}
+	case OP_ACOS:
+	case OP_ASIN:
+	{
+		if (a.hi < -1 || a.lo > 1) return emptyInterval();
+		maybeUndefined |= a.lo < -1 || a.hi > 1;
+		double lo = std::max(a.lo, -1.0), hi = std::min(a.hi, 1.0);
+		if (op == OP_ACOS) return bounds(acos(hi), acos(lo), maybeUndefined);
+		return bounds(asin(lo), asin(hi), maybeUndefined);
+	}
+	case OP_ATAN: return bounds(atan(a.lo), atan(a.hi), maybeUndefined);
+	case OP_LOG:
+	{
+		if (a.hi < 0) return emptyInterval();
+		maybeUndefined |= a.lo < 0;
+		return bounds(log(std::max(a.lo, 0.0)), log(a.hi), maybeUndefined);
+	}
+	}
+	return a;
+}
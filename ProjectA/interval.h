@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+Bounds of a value over a range of inputs, e.g. of an equation over a rectangular x/z cell
+Bounds aren't rounded outwards, they are conservative up to floating point rounding
+*/
+struct Interval
+{
+	double lo = 0;
+	double hi = 0;
+	bool maybeUndefined = false; // The value may be undefined (NaN) somewhere in the range, e.g. log of negatives
+	bool empty = false; // The value is undefined everywhere in the range, lo and hi are meaningless
+
+	static Interval Point(double value);
+	bool Contains(double value) const { return !empty && lo <= value && value <= hi; };
+	double Width() const { return hi - lo; };
+};
+
+// Bounds of op(a, b) for "op" one of opCodes, "b" is ignored for single operand operations
+Interval EvaluateIntervalOperation(unsigned int op, const Interval& a, const Interval& b);
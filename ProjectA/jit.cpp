@@ -0,0 +1,142 @@
+#include "jit.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <unistd.h>
+#define NATIVE_EQUATIONS
+#endif
+
+static string compilerCommand()
+{
+	const char* cc = getenv("CC");
+	return (cc != nullptr && *cc != 0) ? cc : "cc";
+}
+
+static string registerName(unsigned int reg)
+{
+	return "r" + std::to_string(reg);
+}
+
+// Exact C literal for a constant, hex floats keep every bit of the value
+static string constantLiteral(double value)
+{
+	if (std::isnan(value)) return "NAN";
+	if (std::isinf(value)) return value > 0 ? "INFINITY" : "-INFINITY";
+
+	char literal[64];
+	snprintf(literal, sizeof(literal), "%a", value);
+	return literal;
+}
+
+static string instructionExpression(const Instruction& ins)
+{
+	string a = registerName(ins.a);
+	string b = registerName(ins.b);
+	switch (ins.op)
+	{
+	case OP_ADD: return a + " + " + b;
+	case OP_SUB: return a + " - " + b;
+	case OP_MUL: return a + " * " + b;
+	case OP_DIV: return a + " / " + b;
+	case OP_POW: return "pow(" + a + ", " + b + ")";
+	case OP_COS: return "cos(" + a + ")";
+	case OP_SIN: return "sin(" + a + ")";
+	case OP_TAN: return "tan(" + a + ")";
+	case OP_ACOS: return "acos(" + a + ")";
+	case OP_ASIN: return "asin(" + a + ")";
+	case OP_ATAN: return "atan(" + a + ")";
+	case OP_LOG: return "log(" + a + ")";
+	}
+	return a;
+}
+
+/*
+Translates the program into a C function looping over the samples, one local per register
+*/
+string GenerateEquationSource(const EquationProgram& program, const char* functionName)
+{
+	unsigned int constBase = (unsigned int)program.VariableCount();
+	unsigned int tempBase = constBase + (unsigned int)program.Constants().size();
+
+	string source = "#include <math.h>\n#include <stddef.h>\n\n";
+	source += string("void ") + functionName + "(const double* const* v, double* out, size_t count)\n{\n";
+	source += "\tfor (size_t i = 0; i < count; i++)\n\t{\n";
+
+	for (unsigned int i = 0; i < constBase; i++)
+	{
+		source += "\t\tdouble " + registerName(i) + " = v[" + std::to_string(i) + "][i];\n";
+	}
+	for (unsigned int i = 0; i < program.Constants().size(); i++)
+	{
+		source += "\t\tconst double " + registerName(constBase + i) + " = " + constantLiteral(program.Constants()[i]) + ";\n";
+	}
+	for (unsigned int i = tempBase; i < program.RegisterCount(); i++)
+	{
+		source += "\t\tdouble " + registerName(i) + ";\n";
+	}
+
+	for (const Instruction& ins : program.Code())
+	{
+		source += "\t\t" + registerName(ins.dst) + " = " + instructionExpression(ins) + ";\n";
+	}
+
+	source += "\t\tout[i] = " + registerName(program.ResultRegister()) + ";\n";
+	source += "\t}\n}\n";
+	return source;
+}
+
+bool NativeEquation::Available()
+{
+#ifdef NATIVE_EQUATIONS
+	static const bool available = system(nullptr) != 0 &&
+		system((compilerCommand() + " --version > /dev/null 2>&1").c_str()) == 0;
+	return available;
+#else
+	return false;
+#endif
+}
+
+NativeEquation::NativeEquation(const EquationProgram& program) : _library(nullptr), _function(nullptr)
+{
+#ifdef NATIVE_EQUATIONS
+	if (!Available()) return;
+
+	const char* tmp = getenv("TMPDIR");
+	string dir = string((tmp != nullptr && *tmp != 0) ? tmp : "/tmp") + "/graph_equationXXXXXX";
+	if (mkdtemp(&dir[0]) == nullptr) return;
+
+	string sourcePath = dir + "/equation.c";
+	string libraryPath = dir + "/equation.so";
+
+	FILE* file = fopen(sourcePath.c_str(), "w");
+	if (file != nullptr)
+	{
+		string source = GenerateEquationSource(program, "graph_equation");
+		bool written = fwrite(source.data(), 1, source.size(), file) == source.size();
+		fclose(file);
+
+		string command = compilerCommand() + " -O3 -march=native -ffp-contract=off -shared -fPIC -o '" + libraryPath + "' '" + sourcePath + "' -lm > /dev/null 2>&1";
+		if (written && system(command.c_str()) == 0)
+		{
+			_library = dlopen(libraryPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+			if (_library != nullptr)
+				_function = (NativeEquationFunc)dlsym(_library, "graph_equation");
+		}
+	}
+
+	// The loaded library stays mapped after its file is gone
+	remove(sourcePath.c_str());
+	remove(libraryPath.c_str());
+	rmdir(dir.c_str());
+#endif
+}
+
+NativeEquation::~NativeEquation()
+{
+#ifdef NATIVE_EQUATIONS
+	if (_library != nullptr) dlclose(_library);
+#endif
+}
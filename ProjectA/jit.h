@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+#include "bytecode.h"
+
+using std::string;
+
+// Same contract as EquationProgram::EvaluateBatch
+typedef void (*NativeEquationFunc)(const double* const* varValues, double* out, size_t count);
+
+/*
+Native code for an equation program. The program is translated to C, built as a shared library by
+the system C compiler ($CC, or "cc") and loaded in-process
+Function() is null when no compiler or dynamic loader is available, callers then keep interpreting
+*/
+class NativeEquation
+{
+public:
+	explicit NativeEquation(const EquationProgram& program);
+	~NativeEquation();
+	NativeEquation(const NativeEquation&) = delete;
+	NativeEquation& operator=(const NativeEquation&) = delete;
+
+	NativeEquationFunc Function() const { return _function; };
+
+	static bool Available();
+
+private:
+	void* _library;
+	NativeEquationFunc _function;
+};
+
+string GenerateEquationSource(const EquationProgram& program, const char* functionName);
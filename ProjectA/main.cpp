@@ -9,12 +9,14 @@
 // self implements
 #include "Console.h"
 #include "Graph.h"
+#include "profiler.h"
 // shaders
 #include "shaders.h"
 
 #include <vector>
 #include <string>
 #include <iostream>
+#include <algorithm>
 
 using std::vector;
 using std::string;
@@ -50,6 +52,16 @@ float zpos = -40;
 float xang = 0;
 float yang = 0;
 float fov = 90;
+//perspective matrix of fov, row major
+float perspectiveMatrix[16];
+
+//frames are only drawn when something changes, see main
+//frames still to draw before the loop waits for events again, input leaves a few so ImGui's widgets can settle
+int frames_to_draw = 2;
+const int ui_settle_frames = 3;
+//seconds waited for events at a time, while graph jobs run their results are checked for more often
+const double idle_timeout = 0.5;
+const double job_poll_interval = 0.005;
 
 //Callbacks
 
@@ -75,6 +87,12 @@ MessageCallback(GLenum source,
 
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
+void cursor_pos_callback(GLFWwindow* window, double x, double y);
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void char_callback(GLFWwindow* window, unsigned int c);
+void window_refresh_callback(GLFWwindow* window);
+void window_focus_callback(GLFWwindow* window, int focused);
 
 void perspective(float fov);
 
@@ -96,6 +114,13 @@ void initBackends()
 	//glfwSetKeyCallback(window, nullptr);
 	glfwSetScrollCallback(window, scroll_callback);
 	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+	// Only mark the next frames to be drawn, ImGui chains them into its own callbacks
+	glfwSetCursorPosCallback(window, cursor_pos_callback);
+	glfwSetMouseButtonCallback(window, mouse_button_callback);
+	glfwSetKeyCallback(window, key_callback);
+	glfwSetCharCallback(window, char_callback);
+	glfwSetWindowRefreshCallback(window, window_refresh_callback);
+	glfwSetWindowFocusCallback(window, window_focus_callback);
 	glfwSwapInterval(1); // Enable Vsync
 
 	GLenum err = glewInit();
@@ -228,12 +253,13 @@ void perspective(float fov)
 	const float pi = 4 * atan(1);
 	const float fFrustumScale = 1 / tan((fov / 2) * (pi / 180));
 
-	const float perspectiveMatrix[16] = {
+	const float matrix[16] = {
 		fFrustumScale,	0,	0,	0,
 		0,	fFrustumScale,  0,	0,
 		0,	0,	(fzFar + fzNear) / (fzNear - fzFar),  -1,
 		0,	0,	(2 * fzFar * fzNear) / (fzNear - fzFar),  0
 	};
+	std::copy(matrix, matrix + 16, perspectiveMatrix);
 
 	//bind data to shader
 	glUseProgram(program);
@@ -254,6 +280,11 @@ void draw(GraphManager& gm) {
 	//setup offset + angle for everything
 	glUniform3f(uniform_offset, xpos, ypos, zpos);
 	glUniform2f(uniform_angle, xang, yang);
+	//the graphs keep their own copy of the camera instead of reading it back from GL
+	int width, height;
+	glfwGetFramebufferSize(window, &width, &height);
+	const float offset[3] = { xpos, ypos, zpos }, angle[2] = { xang, yang };
+	gm.SetCamera(perspectiveMatrix, offset, angle, height);
 
 	//color for axis
 	glUniform4f(uniform_color, 0.3f, 0.4f, 0.7f, 1.0f);
@@ -280,8 +311,9 @@ void draw(GraphManager& gm) {
 }
 
 
-//keyboard handling (used for continuous movement of angles/position)
-void keyboard() {
+//keyboard handling (used for continuous movement of angles/position), returns true if the camera moved
+bool keyboard() {
+	float moved[5] = { xpos, ypos, zpos, xang, yang };
 	//keyboard management
 	if (glfwGetKey(window, 'A') == GLFW_PRESS) {
 		xpos = xpos - 0.1;
@@ -323,19 +355,35 @@ void keyboard() {
 		fov -= 0.2;
 		perspective(fov);
 	}*/
+	return moved[0] != xpos || moved[1] != ypos || moved[2] != zpos || moved[3] != xang || moved[4] != yang;
+}
+
+//input for ImGui, or anything else the next frames have to show
+void redraw()
+{
+	frames_to_draw = std::max(frames_to_draw, ui_settle_frames);
 }
 
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
 	double* zoom = (double*)getWindowVar(window, "graphZoom");
 	*zoom += 0.1 * -yoffset;
+	redraw();
 }
 
 //glfw resize
 void framebuffer_size_callback(GLFWwindow* window, int width, int height) {
 	glViewport(0, 0, width, height);
+	redraw();
 }
 
+void cursor_pos_callback(GLFWwindow* window, double x, double y) { redraw(); }
+void mouse_button_callback(GLFWwindow* window, int button, int action, int mods) { redraw(); }
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) { redraw(); }
+void char_callback(GLFWwindow* window, unsigned int c) { redraw(); }
+void window_refresh_callback(GLFWwindow* window) { redraw(); }
+void window_focus_callback(GLFWwindow* window, int focused) { redraw(); }
+
 void* getWindowVar(GLFWwindow* window, string varName)
 {
 	auto vars = (vector<std::pair<string, void*>>*)glfwGetWindowUserPointer(window);
@@ -371,6 +419,7 @@ int main(int argc, char const* argv[])
 
 	//main loop
 	while (!glfwGetKey(window, GLFW_KEY_ESCAPE) && !glfwWindowShouldClose(window)) {
+		Profiler::NewFrame();
 		//clear the screen
 		glClear(GL_COLOR_BUFFER_BIT);
 		glClearColor(0.1, 0.1, 0.1, 1.0);
@@ -386,16 +435,33 @@ int main(int argc, char const* argv[])
 
 		if (show_console)
 			console.Draw(&show_console);
-		ImGui::Render();
-		ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+		//the profiler's panel shows while it records, closing it stops recording
+		if (Profiler::Enabled())
+		{
+			bool show_profiler = true;
+			Profiler::DrawPanel(&show_profiler);
+			if (!show_profiler)
+				Profiler::SetEnabled(false);
+		}
+		{
+			ProfileScope scope("ImGui");
+			GpuProfileScope gpuScope("ImGui");
+			ImGui::Render();
+			ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+		}
 
 		glfwSwapBuffers(window);
+		if (frames_to_draw > 0) frames_to_draw--;
 		glfwPollEvents();
 
 		graphFocused = !(console.IsFocused() || graphManager._focused);
-		//keyboard
-		if(graphFocused)
-			keyboard();
+		//keyboard, a moved camera is drawn in the next frame
+		if (graphFocused && keyboard())
+			frames_to_draw = std::max(frames_to_draw, 1);
+
+		//nothing changed, wait for events or for the graphs' jobs instead of drawing the same frame again
+		while (frames_to_draw == 0 && !graphManager.HasJobResults() && !glfwWindowShouldClose(window))
+			glfwWaitEventsTimeout(graphManager.JobsRunning() ? job_poll_interval : idle_timeout);
 	} //end of loop
 
 	// Cleanup
@@ -0,0 +1,355 @@
+#include "meshexport.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "profiler.h"
+
+using std::vector;
+
+// Bytes written out at a time
+constexpr size_t writeBufferSize = 1 << 20;
+// Samples evaluated at a time, over as many whole rows as that makes
+constexpr size_t blockSamples = 1 << 18;
+// Bytes kept for the JSON chunk of GLB files, it's written again once the counts are known
+constexpr size_t glbJsonSize = 2048;
+// Bytes of a vertex of PLY and GLB files, its position then its normal
+constexpr size_t vertexSize = 6 * sizeof(float);
+
+/*
+Output written through a fixed size buffer. Once a write fails the later ones are skipped, Flush tells whether any did
+Every format is little endian, like the machines the editor runs on, values are copied out as they are
+*/
+class BufferedWriter
+{
+public:
+	explicit BufferedWriter(FILE* file) : _file(file), _buffer(writeBufferSize), _used(0), _written(0), _failed(false) {};
+
+	void Write(const void* data, size_t size)
+	{
+		if (_used + size > _buffer.size()) Flush();
+		memcpy(_buffer.data() + _used, data, size);
+		_used += size;
+		_written += size;
+	}
+	template<typename T> void Write(const T& value) { Write(&value, sizeof(T)); };
+
+	bool Flush()
+	{
+		if (!_failed && _used > 0) _failed = fwrite(_buffer.data(), 1, _used, _file) != _used;
+		_used = 0;
+		return !_failed;
+	}
+
+	size_t Written() const { return _written; };
+
+private:
+	FILE* _file;
+	vector<char> _buffer;
+	size_t _used;
+	size_t _written;
+	bool _failed;
+};
+
+/*
+A row of samples as they're written out, along x at one z
+*/
+struct SampleRow
+{
+	vector<float> positions; // x, y, z of every sample
+	vector<float> normals;
+	vector<char> defined;
+	vector<uint32_t> indices; // Vertex of every defined sample, in PLY and GLB files
+};
+
+/*
+Evaluates row "r" of the grid into "row", "xs" are the samples' x and the rest scratch space of a row's size
+*/
+static void evaluateRow(const EquationProgram& equation, size_t r, double extent, size_t resolution, const vector<double>& xs,
+	vector<double>& zs, vector<double>& ys, vector<vector<double>>& derivatives, SampleRow& row)
+{
+	const size_t n = resolution + 1;
+	double z = -extent + 2 * extent * r / resolution;
+	std::fill(zs.begin(), zs.end(), z);
+
+	int xIndex = equation.VariableIndex('x');
+	int zIndex = equation.VariableIndex('z');
+	vector<const double*> vars(equation.VariableCount(), xs.data());
+	if (zIndex >= 0) vars[zIndex] = zs.data();
+	vector<double*> derivativePtrs;
+	for (vector<double>& derivative : derivatives) derivativePtrs.push_back(derivative.data());
+
+	EvaluationFrame frame;
+	equation.EvaluateDerivativesBatch(vars.data(), ys.data(), derivativePtrs.data(), n, frame);
+
+	row.positions.resize(n * 3);
+	row.normals.resize(n * 3);
+	row.defined.resize(n);
+	row.indices.resize(n);
+	for (size_t c = 0; c < n; c++)
+	{
+		row.defined[c] = std::isfinite(ys[c]);
+		row.positions[c * 3] = (float)xs[c];
+		row.positions[c * 3 + 1] = row.defined[c] ? (float)ys[c] : 0;
+		row.positions[c * 3 + 2] = (float)z;
+
+		double normalX = xIndex >= 0 ? -derivatives[xIndex][c] : 0, normalZ = zIndex >= 0 ? -derivatives[zIndex][c] : 0;
+		double length = sqrt(normalX * normalX + 1 + normalZ * normalZ);
+		if (!std::isfinite(length))
+		{
+			normalX = normalZ = 0;
+			length = 1;
+		}
+		row.normals[c * 3] = (float)(normalX / length);
+		row.normals[c * 3 + 1] = (float)(1 / length);
+		row.normals[c * 3 + 2] = (float)(normalZ / length);
+	}
+}
+
+// STL facets carry their own normal, pointing up the surface like the corners' winding
+static void writeStlTriangle(BufferedWriter& out, const float* a, const float* b, const float* c)
+{
+	float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] }, v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+	float normal[3] = { u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2], u[0] * v[1] - u[1] * v[0] };
+	float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+	for (float& component : normal) component = length > 0 ? component / length : 0;
+
+	char facet[50] = {};
+	memcpy(facet, normal, 12);
+	memcpy(facet + 12, a, 12);
+	memcpy(facet + 24, b, 12);
+	memcpy(facet + 36, c, 12);
+	out.Write(facet, sizeof(facet));
+}
+
+// Fixed width counts, so the header keeps its size when written again with the final ones
+static string plyHeader(size_t vertices, size_t triangles)
+{
+	char header[512];
+	snprintf(header, sizeof(header), "ply\nformat binary_little_endian 1.0\ncomment Exported from Graph-Editor\n"
+		"element vertex %020llu\nproperty float x\nproperty float y\nproperty float z\n"
+		"property float nx\nproperty float ny\nproperty float nz\n"
+		"element face %020llu\nproperty list uchar uint vertex_indices\nend_header\n",
+		(unsigned long long)vertices, (unsigned long long)triangles);
+	return header;
+}
+
+/*
+One mesh of interleaved positions and normals, indexed by 32 bit indices following them in the BIN chunk
+The JSON is padded with spaces to glbJsonSize, returns an empty string if it doesn't fit
+*/
+static string glbJson(size_t vertices, size_t triangles, const float lo[3], const float hi[3])
+{
+	size_t vertexBytes = vertices * vertexSize, indexBytes = triangles * 3 * sizeof(uint32_t);
+	char json[glbJsonSize + 1];
+	int length = snprintf(json, sizeof(json),
+		"{\"asset\":{\"version\":\"2.0\",\"generator\":\"Graph-Editor\"},\"scene\":0,\"scenes\":[{\"nodes\":[0]}],"
+		"\"nodes\":[{\"mesh\":0}],\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0,\"NORMAL\":1},\"indices\":2,\"mode\":4}]}],"
+		"\"buffers\":[{\"byteLength\":%llu}],"
+		"\"bufferViews\":[{\"buffer\":0,\"byteOffset\":0,\"byteLength\":%llu,\"byteStride\":%d,\"target\":34962},"
+		"{\"buffer\":0,\"byteOffset\":%llu,\"byteLength\":%llu,\"target\":34963}],"
+		"\"accessors\":[{\"bufferView\":0,\"byteOffset\":0,\"componentType\":5126,\"count\":%llu,\"type\":\"VEC3\","
+		"\"min\":[%.9g,%.9g,%.9g],\"max\":[%.9g,%.9g,%.9g]},"
+		"{\"bufferView\":0,\"byteOffset\":12,\"componentType\":5126,\"count\":%llu,\"type\":\"VEC3\"},"
+		"{\"bufferView\":1,\"byteOffset\":0,\"componentType\":5125,\"count\":%llu,\"type\":\"SCALAR\"}]}",
+		(unsigned long long)(vertexBytes + indexBytes), (unsigned long long)vertexBytes, (int)vertexSize,
+		(unsigned long long)vertexBytes, (unsigned long long)indexBytes, (unsigned long long)vertices,
+		lo[0], lo[1], lo[2], hi[0], hi[1], hi[2], (unsigned long long)vertices, (unsigned long long)(triangles * 3));
+	if (length < 0 || (size_t)length > glbJsonSize) return "";
+	return string(json, length) + string(glbJsonSize - length, ' ');
+}
+
+static void writeGlbHeader(FILE* file, const string& json, size_t binBytes)
+{
+	uint32_t header[5] = { 0x46546c67, 2, (uint32_t)(12 + 8 + json.size() + 8 + binBytes), (uint32_t)json.size(), 0x4e4f534a };
+	uint32_t binHeader[2] = { (uint32_t)binBytes, 0x004e4942 };
+	fwrite(header, sizeof(header), 1, file);
+	fwrite(json.data(), 1, json.size(), file);
+	fwrite(binHeader, sizeof(binHeader), 1, file);
+}
+
+/*
+The file starts with a header of placeholder counts. Vertices and STL facets go right into it, PLY and GLB face indices
+into a temporary file appended once the last row is written, then the header is written again with the final counts
+*/
+MeshExportResult ExportMesh(const EquationProgram& equation, const string& path, meshFormats format, double extent,
+	size_t resolution, ThreadPool& threadPool)
+{
+	ProfileScope scope("Export mesh");
+	auto start = std::chrono::steady_clock::now();
+	MeshExportResult result;
+	const size_t n = resolution + 1;
+	const bool indexed = format != MESH_STL;
+
+	// Counts are 32 bit in every format, so are GLB file sizes
+	double maxVertices = (double)n * n, maxTriangles = 2.0 * resolution * resolution;
+	double maxGlbBytes = 28 + glbJsonSize + maxVertices * vertexSize + maxTriangles * 3 * sizeof(uint32_t);
+	if (resolution == 0 || (format == MESH_STL && maxTriangles > UINT32_MAX) || (indexed && maxVertices > UINT32_MAX) ||
+		(format == MESH_GLB && maxGlbBytes > UINT32_MAX))
+	{
+		result.error = "The resolution is out of the range the format can hold";
+		return result;
+	}
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr)
+	{
+		result.error = "Couldn't open " + path;
+		return result;
+	}
+	FILE* faceFile = indexed ? tmpfile() : nullptr;
+	if (indexed && faceFile == nullptr)
+	{
+		fclose(file);
+		remove(path.c_str());
+		result.error = "Couldn't create a temporary file for the faces";
+		return result;
+	}
+
+	BufferedWriter out(file);
+	BufferedWriter faces(faceFile);
+	float lo[3] = { std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity() };
+	float hi[3] = { -lo[0], -lo[1], -lo[2] };
+	if (format == MESH_STL)
+	{
+		char header[80] = "Binary STL exported from Graph-Editor";
+		out.Write(header, sizeof(header));
+		out.Write((uint32_t)0);
+	}
+	else if (format == MESH_PLY)
+	{
+		string header = plyHeader(0, 0);
+		out.Write(header.data(), header.size());
+	}
+	else
+	{
+		vector<char> header(28 + glbJsonSize, ' ');
+		out.Write(header.data(), header.size());
+	}
+	size_t headerBytes = out.Written();
+
+	// Triangles of each quad follow the drawn strips: from the row above (lower z) down, both facing up the surface
+	auto writeRow = [&](SampleRow& row, const SampleRow* above)
+	{
+		for (size_t c = 0; indexed && c < n; c++)
+		{
+			if (!row.defined[c]) continue;
+			row.indices[c] = (uint32_t)result.vertices++;
+			out.Write(&row.positions[c * 3], 12);
+			out.Write(&row.normals[c * 3], 12);
+			for (int axis = 0; axis < 3; axis++)
+			{
+				lo[axis] = std::min(lo[axis], row.positions[c * 3 + axis]);
+				hi[axis] = std::max(hi[axis], row.positions[c * 3 + axis]);
+			}
+		}
+		if (above == nullptr) return;
+
+		auto triangle = [&](const SampleRow& ra, size_t a, const SampleRow& rb, size_t b, const SampleRow& rc, size_t c)
+		{
+			if (!ra.defined[a] || !rb.defined[b] || !rc.defined[c]) return;
+			result.triangles++;
+			if (format == MESH_STL) writeStlTriangle(out, &ra.positions[a * 3], &rb.positions[b * 3], &rc.positions[c * 3]);
+			else
+			{
+				if (format == MESH_PLY) faces.Write((uint8_t)3);
+				uint32_t corners[3] = { ra.indices[a], rb.indices[b], rc.indices[c] };
+				faces.Write(corners, sizeof(corners));
+			}
+		};
+		for (size_t c = 0; c < resolution; c++)
+		{
+			triangle(*above, c, row, c, *above, c + 1);
+			triangle(row, c, row, c + 1, *above, c + 1);
+		}
+	};
+
+	vector<double> xs(n);
+	for (size_t c = 0; c < n; c++) xs[c] = -extent + 2 * extent * c / resolution;
+	const size_t blockRows = std::max<size_t>(1, blockSamples / n);
+	vector<SampleRow> block(std::min(blockRows, n));
+	SampleRow above;
+	for (size_t first = 0; first < n; first += blockRows)
+	{
+		size_t rows = std::min(blockRows, n - first);
+		threadPool.ParallelFor(rows, 1, [&](size_t begin, size_t end)
+		{
+			vector<double> zs(n), ys(n);
+			vector<vector<double>> derivatives(equation.VariableCount(), vector<double>(n, 0));
+			for (size_t r = begin; r < end; r++)
+			{
+				evaluateRow(equation, first + r, extent, resolution, xs, zs, ys, derivatives, block[r]);
+			}
+		});
+		for (size_t r = 0; r < rows; r++)
+		{
+			writeRow(block[r], first + r > 0 ? (r > 0 ? &block[r - 1] : &above) : nullptr);
+		}
+		std::swap(above, block[rows - 1]);
+	}
+
+	bool written = out.Flush() && faces.Flush() && result.triangles > 0;
+	if (written && indexed)
+	{
+		// The faces follow the vertices
+		rewind(faceFile);
+		vector<char> chunk(writeBufferSize);
+		size_t read;
+		while ((read = fread(chunk.data(), 1, chunk.size(), faceFile)) > 0) out.Write(chunk.data(), read);
+		written = !ferror(faceFile) && out.Flush();
+	}
+	if (faceFile != nullptr) fclose(faceFile);
+
+	if (written)
+	{
+		fseek(file, 0, SEEK_SET);
+		if (format == MESH_STL)
+		{
+			uint32_t triangles = (uint32_t)result.triangles;
+			fseek(file, 80, SEEK_SET);
+			fwrite(&triangles, sizeof(triangles), 1, file);
+		}
+		else if (format == MESH_PLY)
+		{
+			string header = plyHeader(result.vertices, result.triangles);
+			fwrite(header.data(), 1, header.size(), file);
+		}
+		else
+		{
+			string json = glbJson(result.vertices, result.triangles, lo, hi);
+			written = !json.empty();
+			if (written) writeGlbHeader(file, json, out.Written() - headerBytes);
+		}
+	}
+	written &= !ferror(file);
+	written &= fclose(file) == 0;
+
+	if (!written)
+	{
+		remove(path.c_str());
+		result.error = result.triangles == 0 ? "The graph is undefined over the whole exported area" : "Couldn't write " + path;
+		return result;
+	}
+	result.success = true;
+	result.bytes = out.Written();
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return result;
+}
+
+bool MeshFormatFromName(string name, meshFormats& format)
+{
+	if (!name.empty() && name[0] == '.') name.erase(0, 1);
+	for (char& c : name) c = (char)toupper((unsigned char)c);
+
+	if (name == "STL") format = MESH_STL;
+	else if (name == "PLY") format = MESH_PLY;
+	else if (name == "GLB") format = MESH_GLB;
+	else return false;
+	return true;
+}
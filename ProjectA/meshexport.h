@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+
+#include "bytecode.h"
+#include "threadpool.h"
+
+using std::string;
+
+// File formats meshes are exported in, all binary
+enum meshFormats
+{
+	MESH_STL = 0, MESH_PLY, MESH_GLB
+};
+
+/*
+Outcome of a mesh export, "error" tells what went wrong when it failed
+*/
+struct MeshExportResult
+{
+	bool success = false;
+	string error;
+	size_t vertices = 0; // STL has none of its own, every triangle repeats its corners
+	size_t triangles = 0;
+	size_t bytes = 0; // Of the whole file
+	double seconds = 0;
+};
+
+/*
+Writes the surface of "equation" over [-extent, extent] along x and z, "resolution" quads a side, to "path"
+Rows of samples are evaluated a block at a time on "threadPool" and their triangles streamed out through a fixed size
+buffer, the indices of PLY and GLB faces through a temporary file, so no more than a block of the mesh is ever in memory
+Triangles touching samples where the equation is undefined are left out, like when drawn
+*/
+MeshExportResult ExportMesh(const EquationProgram& equation, const string& path, meshFormats format, double extent,
+	size_t resolution, ThreadPool& threadPool);
+// Format named "name" (stl, ply or glb, in any case, with or without a leading dot), false if there's none
+// JSON glTF (.gltf) isn't one, only its binary container is written
+bool MeshFormatFromName(string name, meshFormats& format);
@@ -1,4 +1,8 @@
 #include "parsing.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
 #include <stack>
 
 constexpr char upper(char c)
@@ -7,23 +11,77 @@ constexpr char upper(char c)
 	return c;
 }
 
-bool isBracketPacked(string str)
+nodeIndex EquationTree::AddConstant(double value)
 {
-	size_t bracketStack = 0;
-	for (char c : str)
+	EquationNode node;
+	node._value = value;
+	_nodes.push_back(node);
+	return (nodeIndex)_nodes.size() - 1;
+}
+
+nodeIndex EquationTree::AddVariable(size_t var)
+{
+	EquationNode node;
+	node._op = OP_VAR;
+	node._var = (unsigned int)var;
+	_nodes.push_back(node);
+	return (nodeIndex)_nodes.size() - 1;
+}
+
+nodeIndex EquationTree::AddOperation(opCodes op, nodeIndex left, nodeIndex right)
+{
+	EquationNode node;
+	node._op = op;
+	node._left = left;
+	node._right = right;
+	_nodes.push_back(node);
+	return (nodeIndex)_nodes.size() - 1;
+}
+
+double EquationTree::Evaluate(nodeIndex index, const double* vars) const
+{
+	const EquationNode& node = _nodes[index];
+	switch (node._op)
+	{
+	case OP_CONST: return node._value;
+	case OP_VAR: return vars[node._var];
+	default:
 	{
-		if (c == '(') bracketStack++;
-		else if (c == ')') bracketStack--;
-		else if (bracketStack == 0) return false;
+		double left = Evaluate(node._left, vars);
+		double right = node._right != noNode ? Evaluate(node._right, vars) : 0;
+		return ApplyOperation(node._op, left, right);
+	}
 	}
-	return true;
 }
 
+double ApplyOperation(opCodes op, double a, double b)
+{
+	switch (op)
+	{
+	case OP_ADD: return a + b;
+	case OP_SUB: return a - b;
+	case OP_MUL: return a * b;
+	case OP_DIV: return a / b;
+	case OP_POW: return pow(a, b);
+	case OP_COS: return cos(a);
+	case OP_SIN: return sin(a);
+	case OP_TAN: return tan(a);
+	case OP_ACOS: return acos(a);
+	case OP_ASIN: return asin(a);
+	case OP_ATAN: return atan(a);
+	case OP_LOG: return log(a);
+	default: return a;
+	}
+}
+
+static const char* const missingParameterError = "Missing parameter/empty input";
+static const char* const invalidParameterError = "Found invalid parameter, parameter must be a single number/existing variable name";
+
 /*
-Validates bracket stacking, purely for exception info
+Validates bracket stacking, purely for error info
 Returns position of unmatched bracket, or npos
 */
-size_t unmatchedBracket(string str)
+size_t unmatchedBracket(string_view str)
 {
 	// TODO: support all bracket types?
 	std::stack<size_t> brackets;
@@ -43,225 +101,305 @@ size_t unmatchedBracket(string str)
 	else return brackets.top();
 }
 
-void LRstripWhites(string& str)
+static bool isLetter(char c)
 {
-	size_t pos = str.find_first_not_of(' ');
-	str.erase(str.begin(), str.begin() + pos);
-	pos = str.find_last_not_of(' ');
-	str.erase(str.begin() + (pos + 1), str.end());
+	return upper(c) >= 'A' && upper(c) <= 'Z';
+}
+
+// Case insensitive check for "prefix" at "pos" in "str"
+static bool matchesAt(string_view str, size_t pos, const string& prefix)
+{
+	if (str.length() - pos < prefix.length()) return false;
+	for (size_t i = 0; i < prefix.length(); i++)
+	{
+		if (upper(str[pos + i]) != prefix[i]) return false;
+	}
+	return true;
 }
 
+enum tokenTypes
+{
+	TOKEN_END = 0, TOKEN_NUMBER, TOKEN_VAR, TOKEN_FUNCTION,
+	TOKEN_OPERATOR, TOKEN_OPEN, TOKEN_CLOSE, TOKEN_INVALID
+};
+
+struct Token
+{
+	tokenTypes type;
+	char op; // TOKEN_OPERATOR
+	size_t pos, end;
+	union
+	{
+		size_t index; // Variable index for TOKEN_VAR, mathFunctions value for TOKEN_FUNCTION
+		double value; // TOKEN_NUMBER
+		const char* error; // TOKEN_INVALID
+	};
+};
+
 /*
-Return the position of the first operator character from "operators" in string, skipping bracketed text
+Single pass tokenizer and precedence climbing parser over the equation text
+Operators by increasing precedence: "+ -", "* /", "^" (right associative), then function application,
+so "sin x^2" is (sin x)^2. Errors are reported through the diagnostic, never thrown
 */
-size_t findOperator(string str, string operators, bool reverse = false)
+class EquationParser
 {
-	// TODO: use stack object to support all bracket types?
-	size_t bracketStack = 0;
+public:
+	EquationParser(string_view text, const vector<char>& varNames, EquationTree& tree, EquationDiagnostic& diagnostic) :
+		_text(text), _varNames(varNames), _tree(tree), _diagnostic(diagnostic), _current(0), _lastOperand(0) {};
 
-	if (reverse) std::reverse(str.begin(), str.end());
-
-	char curr = 0;
-	for (size_t i = 0; i < str.length(); i++)
+	bool Parse()
 	{
-		curr = str[i];
-		if (curr == '(')
-		{
-			bracketStack++;
-		}
-		else if (curr == ')')
-		{
-			bracketStack--;
-		}
-		else if (bracketStack == 0 && (operators.find(curr) != operators.npos))
+		size_t pos = unmatchedBracket(_text);
+		if (pos != _text.npos)
 		{
-			if (reverse) return str.length() - 1 - i;
-			return i;
+			fail("Found unmatched bracket", pos);
+			return false;
 		}
-	}
 
-	return str.npos;
-}
+		tokenize();
+		// Numbers, variables, functions and operators add one node each, so the arena never grows while parsing
+		_tree.Reserve(std::count_if(_tokens.begin(), _tokens.end(), [](const Token& token) { return token.type != TOKEN_OPEN && token.type != TOKEN_CLOSE; }));
+		nodeIndex root = parseExpression(0);
+		if (root == noNode) return false;
+		_tree.SetRoot(root);
+		return true;
+	}
 
+private:
+	void tokenize()
+	{
+		size_t pos = 0;
+		while (true)
+		{
+			while (pos < _text.length() && _text[pos] == ' ') pos++;
+			Token token = { TOKEN_END, 0, pos, pos, {0} };
+			if (pos == _text.length())
+			{
+				_tokens.push_back(token);
+				return;
+			}
 
+			char c = _text[pos];
+			if (c == '+' || c == '-' || c == '*' || c == '/' || c == '^')
+			{
+				token.type = TOKEN_OPERATOR;
+				token.op = c;
+				token.end = pos + 1;
+			}
+			else if (c == '(' || c == ')')
+			{
+				token.type = c == '(' ? TOKEN_OPEN : TOKEN_CLOSE;
+				token.end = pos + 1;
+			}
+			else if (isLetter(c))
+			{
+				tokenizeName(token);
+			}
+			else
+			{
+				tokenizeNumber(token);
+			}
 
-pair<int, size_t> getMathFunction(string equation)
-{
-	void* func = nullptr;
-	for (char& c : equation) c = upper(c);
+			_tokens.push_back(token);
+			pos = token.end;
+		}
+	}
 
-	for (int i = 0; i < funcNames.size(); i++)
+	// Function names, variables, then the "inf"/"nan" literals
+	void tokenizeName(Token& token)
 	{
-		for (string funcName : funcNames[i])
+		size_t longest = 0;
+		for (size_t i = 0; i < funcNames.size(); i++)
 		{
-			if (equation.find(funcName) == 0)
+			for (const string& funcName : funcNames[i])
 			{
-				return { i, funcName.length() };
+				if (funcName.length() > longest && matchesAt(_text, token.pos, funcName))
+				{
+					longest = funcName.length();
+					token.type = TOKEN_FUNCTION;
+					token.index = i;
+				}
 			}
 		}
-	}
-
-	return { NONE, equation.npos };
-}
+		if (longest > 0)
+		{
+			token.end = token.pos + longest;
+			return;
+		}
 
-unique_ptr<EquationNode> GenerateEquationTree(string equation, vector<pair<char, double>>& vars, size_t substrIndex)
-{
-	unique_ptr<EquationNode> node(new EquationNode);
-	size_t pos;
+		for (size_t i = 0; i < _varNames.size(); i++)
+		{
+			if (upper(_text[token.pos]) == upper(_varNames[i]))
+			{
+				token.type = TOKEN_VAR;
+				token.index = i;
+				token.end = token.pos + 1;
+				return;
+			}
+		}
 
-	// equation pre-processing
+		tokenizeNumber(token);
+	}
 
-	if (substrIndex == 0) // perform once 
+	void tokenizeNumber(Token& token)
 	{
-		pos = unmatchedBracket(equation);
-		if (pos != equation.npos)
-			throw EquationError("Found unmatched bracket", substrIndex + pos);
-	}
+		// strtod needs a terminated string, copy the characters it could possibly consume
+		size_t end = token.pos;
+		while (end < _text.length() && (isLetter(_text[end]) || (_text[end] >= '0' && _text[end] <= '9') ||
+			_text[end] == '.' || _text[end] == '+' || _text[end] == '-'))
+		{
+			end++;
+		}
+		string number(_text.substr(token.pos, end - token.pos));
 
-	pos = equation.find_first_not_of(" ");
-	if (pos == equation.npos)
-		throw EquationError("Missing parameter/empty input", substrIndex);
-	substrIndex += pos;
-	LRstripWhites(equation);
+		char* numberEnd = nullptr;
+		errno = 0;
+		double value = strtod(number.c_str(), &numberEnd);
+		size_t length = numberEnd - number.c_str();
 
-	// Unpack brackets
-	if (isBracketPacked(equation))
-	{
-		equation.erase(equation.begin());
-		equation.erase(equation.end() - 1);
-		substrIndex++;
+		token.end = token.pos + (length > 0 ? length : 1);
+		if (length == 0)
+		{
+			token.type = TOKEN_INVALID;
+			token.error = invalidParameterError;
+		}
+		else if (errno == ERANGE && std::isinf(value))
+		{
+			token.type = TOKEN_INVALID;
+			token.error = "Parameter value too large";
+		}
+		else
+		{
+			token.type = TOKEN_NUMBER;
+			token.value = value;
+		}
 	}
 
-	// End of pre-processing
-	// -- 
-	// Beginning of operator checks
-
-	// Subtraction, division and power care about order, thus we sometimes find in reverse
+	const Token& peek() const { return _tokens[_current]; };
+	const Token& advance() { return _tokens[_current++]; };
 
-	pos = findOperator(equation, "+-", true);
-	if (pos != equation.npos)
+	nodeIndex fail(const char* message, size_t index)
 	{
-		node->_left = (GenerateEquationTree(equation.substr(0, pos), vars, substrIndex));
-		node->_right = (GenerateEquationTree(equation.substr(pos + 1, equation.npos), vars, substrIndex + pos + 1));
-		if (equation[pos] == '+')
-			node->_evalFunc = [](EquationNode* curNode) {return curNode->_left->Evaluate() + curNode->_right->Evaluate(); };
-		else
-			node->_evalFunc = [](EquationNode* curNode) {return curNode->_left->Evaluate() - curNode->_right->Evaluate(); };
-		return node;
+		if (_diagnostic.message.empty())
+		{
+			_diagnostic.message = message;
+			_diagnostic.index = index;
+		}
+		return noNode;
 	}
 
-	pos = findOperator(equation, "*/", true);
-	if (pos != equation.npos)
+	static int bindingPower(char op)
 	{
-		node->_left = (GenerateEquationTree(equation.substr(0, pos), vars, substrIndex));
-		node->_right = (GenerateEquationTree(equation.substr(pos + 1, equation.npos), vars, substrIndex + pos + 1));
-		if (equation[pos] == '*')
-			node->_evalFunc = [](EquationNode* curNode) {return curNode->_left->Evaluate() * curNode->_right->Evaluate(); };
-		else
-			node->_evalFunc = [](EquationNode* curNode) {return curNode->_left->Evaluate() / curNode->_right->Evaluate(); };
-		return node;
+		switch (op)
+		{
+		case '+': case '-': return 1;
+		case '*': case '/': return 2;
+		default: return 3; // '^'
+		}
 	}
 
-	pos = findOperator(equation, "^");
-	if (pos != equation.npos)
+	nodeIndex parseExpression(int minPower)
 	{
-		node->_left = (GenerateEquationTree(equation.substr(0, pos), vars, substrIndex));
-		node->_right = (GenerateEquationTree(equation.substr(pos + 1, equation.npos), vars, substrIndex + pos + 1));
-		node->_evalFunc = [](EquationNode* curNode) {return pow(curNode->_left->Evaluate(), curNode->_right->Evaluate()); };
-		return node;
-	}
+		nodeIndex left = parseOperand();
+		if (left == noNode) return noNode;
 
-	// End of operator checks
-	// --
-	// Beginning of function checks (Trig, log, ...)
+		while (true)
+		{
+			const Token& token = peek();
+			if (token.type == TOKEN_END || token.type == TOKEN_CLOSE) return left;
 
-	pair<int, size_t> mathFunction = getMathFunction(equation);
-	int type = mathFunction.first;
-	pos = mathFunction.second;
-	if (pos != equation.npos)
-	{
-		node->_left = GenerateEquationTree(equation.substr(pos, equation.npos), vars, substrIndex + pos);
+			// Two operands with no operator between them
+			if (token.type != TOKEN_OPERATOR) return fail(invalidParameterError, _lastOperand);
 
-		std::function<double(EquationNode* curNode)> evalFunc;
-		switch (type)
+			int power = bindingPower(token.op);
+			if (power < minPower) return left;
+			advance();
+
+			nodeIndex right = parseExpression(token.op == '^' ? power : power + 1);
+			if (right == noNode) return noNode;
+
+			opCodes op = OP_POW;
+			switch (token.op)
+			{
+			case '+': op = OP_ADD; break;
+			case '-': op = OP_SUB; break;
+			case '*': op = OP_MUL; break;
+			case '/': op = OP_DIV; break;
+			}
+			left = _tree.AddOperation(op, left, right);
+		}
+	}
+
+	nodeIndex parseOperand()
+	{
+		const Token& token = peek();
+		switch (token.type)
 		{
-		case COSINE:
+		case TOKEN_FUNCTION:
 		{
-			evalFunc = [](EquationNode* curNode) {return cos(curNode->_left->Evaluate()); };
-			break;
+			advance();
+			nodeIndex operand = parseOperand();
+			if (operand == noNode) return noNode;
+			return _tree.AddOperation((opCodes)(OP_COS + token.index), operand);
 		}
-		case SINE:
+		case TOKEN_NUMBER:
 		{
-			evalFunc = [](EquationNode* curNode) {return sin(curNode->_left->Evaluate()); };
-			break;
+			_lastOperand = advance().pos;
+			return _tree.AddConstant(token.value);
 		}
-		case TANGENT:
+		case TOKEN_VAR:
 		{
-			evalFunc = [](EquationNode* curNode) {return tan(curNode->_left->Evaluate()); };
-			break;
+			_lastOperand = advance().pos;
+			return _tree.AddVariable(token.index);
 		}
-		case ACOSINE:
+		case TOKEN_OPEN:
 		{
-			evalFunc = [](EquationNode* curNode) {return acos(curNode->_left->Evaluate()); };
-			break;
+			advance();
+			if (peek().type == TOKEN_CLOSE) return fail(invalidParameterError, token.end);
+
+			nodeIndex node = parseExpression(0);
+			if (node == noNode) return noNode;
+			advance(); // Closing bracket, brackets were validated up front
+			_lastOperand = token.pos;
+			return node;
 		}
-		case ASINE:
+		case TOKEN_INVALID:
 		{
-			evalFunc = [](EquationNode* curNode) {return asin(curNode->_left->Evaluate()); };
-			break;
+			return fail(token.error, token.pos);
 		}
-		case ATANGENT:
+		case TOKEN_OPERATOR:
 		{
-			evalFunc = [](EquationNode* curNode) {return atan(curNode->_left->Evaluate()); };
-			break;
+			return fail(missingParameterError, token.pos);
 		}
-		case LOG:
+		default: // End of input or closing bracket, the operand would have been right after the previous token
 		{
-			evalFunc = [](EquationNode* curNode) {return log(curNode->_left->Evaluate()); };
-			break;
+			return fail(missingParameterError, _current > 0 ? _tokens[_current - 1].end : 0);
 		}
 		}
-		node->_evalFunc = evalFunc;
-		return node;
-	}
-
-
-	// End of function checks
-	// -- 
-	// Beginning of raw value checks
-
-
-	for (std::pair<char, double>& var : vars)
-	{
-		if (equation.length() == 1 && upper(equation[0]) == upper(var.first))
-		{
-			double& var_ref = var.second;
-			node->_evalFunc = [&var_ref](EquationNode* curNode) { return var_ref; };
-			return node;
-		}
 	}
 
-	size_t num_end = 0;
-	double value;
-	try
-	{
-		value = std::stod(equation, &num_end);
-	}
-	catch (std::invalid_argument err)
-	{
-		throw EquationError("Found invalid parameter, parameter must be a single number/existing variable name", substrIndex);
-	}
-	catch (std::out_of_range err)
-	{
-		throw EquationError("Parameter value too large", substrIndex);
-	}
+	string_view _text;
+	const vector<char>& _varNames;
+	EquationTree& _tree;
+	EquationDiagnostic& _diagnostic;
+	vector<Token> _tokens;
+	size_t _current;
+	size_t _lastOperand; // Start of the last parsed operand, where juxtaposed operands are reported
+};
 
-	// This covers the case of parameters with no operation between them, for example: "15 23.7" (stod() succeeds here)
-	if (num_end < equation.length())
-	{
-		throw EquationError("Found invalid parameter, parameter must be a single number/existing variable name", substrIndex);
-	}
+EquationTree ParseEquation(string_view equation, const vector<char>& varNames, EquationDiagnostic& diagnostic)
+{
+	diagnostic = EquationDiagnostic();
+	EquationTree tree;
+	EquationParser parser(equation, varNames, tree, diagnostic);
+	if (!parser.Parse()) return EquationTree();
+	return tree;
+}
 
-	node->_evalFunc = [value](EquationNode* curNode) { return value; };
-	return node;
-}
\ No newline at end of file
+EquationTree GenerateEquationTree(string_view equation, const vector<char>& varNames)
+{
+	EquationDiagnostic diagnostic;
+	EquationTree tree = ParseEquation(equation, varNames, diagnostic);
+	if (tree.Empty()) throw EquationError(diagnostic.message, diagnostic.index);
+	return tree;
+}
@@ -1,28 +1,86 @@
 #pragma once
 
-#include <functional>
 #include <string>
+#include <string_view>
 #include <stdexcept>
 #include <vector>
 #include <utility>
 
-#include <memory>
-
 using std::string;
+using std::string_view;
 using std::vector;
-using std::unique_ptr;
 using std::pair;
 
+// Operation performed by an equation node, shared with the compiled form of the equation (see bytecode.h)
+// Function operations are ordered like mathFunctions, so OP_COS + mathFunction gives the function's operation
+enum opCodes
+{
+	OP_CONST = 0, OP_VAR,
+	OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POW,
+	OP_COS, OP_SIN, OP_TAN,
+	OP_ACOS, OP_ASIN, OP_ATAN,
+	OP_LOG
+};
+
+// Index of a node in its EquationTree
+typedef unsigned int nodeIndex;
+constexpr nodeIndex noNode = ~0u;
+
 struct EquationNode
 {
-	unique_ptr<EquationNode> _left;
-	unique_ptr<EquationNode> _right;
-	std::function<double(EquationNode* curNode)> _evalFunc;
+	opCodes _op = OP_CONST;
+	nodeIndex _left = noNode;
+	nodeIndex _right = noNode; // noNode for single operand operations
+	unsigned int _var = 0; // OP_VAR only, index into the variable list the tree was generated with
+	double _value = 0; // OP_CONST only
+};
 
-	double Evaluate() { return _evalFunc(this); };
+/*
+Equation tree kept in one contiguous arena, nodes refer to their children by index
+Adding a node is a bump of the arena and the whole tree is released at once
+A node may have several parents, e.g. the repeated base of an expanded power
+Nodes are added after their operands, so children always come before their parents in the arena
+*/
+class EquationTree
+{
+public:
+	nodeIndex AddConstant(double value);
+	nodeIndex AddVariable(size_t var);
+	nodeIndex AddOperation(opCodes op, nodeIndex left, nodeIndex right = noNode);
+	void Reserve(size_t nodeCount) { _nodes.reserve(nodeCount); };
+
+	const EquationNode& Node(nodeIndex index) const { return _nodes[index]; };
+	nodeIndex Root() const { return _root; };
+	void SetRoot(nodeIndex root) { _root = root; };
+	bool Empty() const { return _root == noNode; };
+	size_t ArenaSize() const { return _nodes.size(); };
+
+	// "vars" holds the variable values in the order of the variable list the tree was generated with
+	double Evaluate(const double* vars) const { return Evaluate(_root, vars); };
+	double Evaluate(nodeIndex index, const double* vars) const;
+
+private:
+	vector<EquationNode> _nodes;
+	nodeIndex _root = noNode;
+};
+
+// op(a, b) for "op" one of the operations, "b" is ignored for single operand operations
+double ApplyOperation(opCodes op, double a, double b);
+
+// Parse error, with the position of the offending character in the equation
+struct EquationDiagnostic
+{
+	string message;
+	size_t index = 0;
 };
 
-unique_ptr<EquationNode> GenerateEquationTree(string equation, vector<pair<char, double>>& vars, size_t substrIndex = 0); // TODO: static in EquationNode?
+// Returns an empty tree and fills "diagnostic" when the equation is invalid
+EquationTree ParseEquation(string_view equation, const vector<char>& varNames, EquationDiagnostic& diagnostic);
+// Same as ParseEquation, throwing EquationError when the equation is invalid
+EquationTree GenerateEquationTree(string_view equation, const vector<char>& varNames);
+EquationTree SimplifyEquationTree(const EquationTree& tree);
+// Nodes with several parents are counted once per parent, like in a tree
+size_t CountEquationNodes(const EquationTree& tree);
 
 // TODO: move func and func names to a structure?
 enum mathFunctions
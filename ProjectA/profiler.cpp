@@ -0,0 +1,241 @@
+#include "profiler.h"
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <imgui.h>
+
+using std::vector;
+
+std::atomic<bool> Profiler::_enabled{ false };
+
+struct ProfileFrame
+{
+	uint64_t number;
+	double start;
+	double duration;
+	vector<ProfileEvent> events;
+};
+
+// A GPU span whose query result isn't read back yet
+struct PendingQuery
+{
+	GLuint query;
+	uint64_t frame;
+	ProfileEvent event;
+};
+
+static const auto epoch = std::chrono::steady_clock::now();
+static std::atomic<int> threadCount{ 0 };
+static thread_local const int threadIndex = threadCount++;
+
+static std::mutex framesMutex; // CPU spans end on any thread
+static std::deque<ProfileFrame> frames; // The last one is the frame being recorded
+static uint64_t frameNumber = 0;
+
+// GL thread only
+static vector<GLuint> freeQueries;
+static std::deque<PendingQuery> pendingQueries;
+static bool gpuScopeOpen = false;
+
+double Profiler::now()
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void Profiler::SetEnabled(bool enabled)
+{
+	if (enabled && !Enabled())
+	{
+		std::lock_guard<std::mutex> lock(framesMutex);
+		frames.clear();
+		frames.push_back({ ++frameNumber, now(), 0, {} });
+	}
+	_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void Profiler::record(const ProfileEvent& event)
+{
+	std::lock_guard<std::mutex> lock(framesMutex);
+	if (frames.empty()) return;
+	frames.back().events.push_back(event);
+	frames.back().events.back().thread = threadIndex;
+}
+
+/*
+Queries finish in the order they were issued, reading stops at the first one still running
+*/
+void Profiler::NewFrame()
+{
+	if (!Enabled() && pendingQueries.empty()) return;
+
+	std::lock_guard<std::mutex> lock(framesMutex);
+	while (!pendingQueries.empty())
+	{
+		PendingQuery& pending = pendingQueries.front();
+		GLint available = 0;
+		glGetQueryObjectiv(pending.query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) break;
+
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(pending.query, GL_QUERY_RESULT, &elapsed);
+		pending.event.duration = elapsed / 1000.0;
+		if (!frames.empty() && pending.frame >= frames.front().number && pending.frame <= frames.back().number)
+		{
+			frames[pending.frame - frames.front().number].events.push_back(pending.event);
+		}
+		freeQueries.push_back(pending.query);
+		pendingQueries.pop_front();
+	}
+
+	if (!Enabled()) return;
+	double start = now();
+	if (!frames.empty()) frames.back().duration = start - frames.back().start;
+	frames.push_back({ ++frameNumber, start, 0, {} });
+	while (frames.size() > history_frames + 1) frames.pop_front();
+}
+
+/*
+Every plot covers the same finished frames, oldest first, in milliseconds
+*/
+void Profiler::DrawPanel(bool* p_open)
+{
+	ImGui::SetNextWindowSize(ImVec2(420, 520), ImGuiCond_FirstUseEver);
+	if (!ImGui::Begin("Profiler", p_open))
+	{
+		ImGui::End();
+		return;
+	}
+
+	vector<float> frameTimes, gpuTimes;
+	std::map<string, vector<float>> spans; // By name, GPU spans prefixed by "GPU "
+	std::map<size_t, vector<float>> graphs; // CPU and GPU time spent on each graph
+	{
+		std::lock_guard<std::mutex> lock(framesMutex);
+		size_t count = frames.empty() ? 0 : frames.size() - 1;
+		frameTimes.resize(count);
+		gpuTimes.resize(count);
+		for (size_t f = 0; f < count; f++)
+		{
+			frameTimes[f] = (float)(frames[f].duration / 1000);
+			for (const ProfileEvent& event : frames[f].events)
+			{
+				float ms = (float)(event.duration / 1000);
+				bool gpu = event.thread < 0;
+				if (gpu) gpuTimes[f] += ms;
+
+				vector<float>& span = spans[gpu ? string("GPU ") + event.name : string(event.name)];
+				span.resize(count);
+				span[f] += ms;
+				if (event.graph == 0) continue;
+				vector<float>& graph = graphs[event.graph];
+				graph.resize(count);
+				graph[f] += ms;
+			}
+		}
+	}
+
+	auto plot = [](const char* label, const vector<float>& values, float height)
+	{
+		float sum = 0, peak = 0;
+		for (float value : values)
+		{
+			sum += value;
+			peak = std::max(peak, value);
+		}
+		char overlay[128];
+		snprintf(overlay, sizeof(overlay), "%s: avg %.2f ms, max %.2f ms", label, values.empty() ? 0 : sum / values.size(), peak);
+		ImGui::PushID(label);
+		ImGui::PlotHistogram("", values.data(), (int)values.size(), 0, overlay, 0, FLT_MAX, ImVec2(-1, height));
+		ImGui::PopID();
+	};
+
+	ImGui::Text("Last %d frames", (int)frameTimes.size());
+	plot("Frame", frameTimes, 80);
+	plot("GPU", gpuTimes, 60);
+	if (ImGui::CollapsingHeader("Spans", ImGuiTreeNodeFlags_DefaultOpen))
+	{
+		for (auto& span : spans)
+		{
+			plot(span.first.c_str(), span.second, 40);
+		}
+	}
+	if (ImGui::CollapsingHeader("Graphs", ImGuiTreeNodeFlags_DefaultOpen))
+	{
+		for (auto& graph : graphs)
+		{
+			string label = "Graph " + std::to_string(graph.first);
+			plot(label.c_str(), graph.second, 40);
+		}
+	}
+	ImGui::End();
+}
+
+/*
+Complete ("X") events, one track per recording thread, one for the GPU and one for the frames themselves
+Span names are string literals of the code, they need no escaping
+*/
+bool Profiler::ExportTrace(const string& path)
+{
+	FILE* file = fopen(path.c_str(), "w");
+	if (file == nullptr) return false;
+
+	const int gpuTrack = 1000, frameTrack = 1001;
+	fprintf(file, "{\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}},\n", gpuTrack);
+	fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Frames\"}}", frameTrack);
+	{
+		std::lock_guard<std::mutex> lock(framesMutex);
+		for (const ProfileFrame& frame : frames)
+		{
+			if (frame.duration > 0)
+			{
+				fprintf(file, ",\n{\"name\":\"Frame\",\"cat\":\"frame\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+					"\"args\":{\"frame\":%llu}}", frame.start, frame.duration, frameTrack, (unsigned long long)frame.number);
+			}
+			for (const ProfileEvent& event : frame.events)
+			{
+				bool gpu = event.thread < 0;
+				fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+					"\"args\":{\"graph\":%zu,\"frame\":%llu}}", event.name, gpu ? "gpu" : "cpu", event.start, event.duration,
+					gpu ? gpuTrack : event.thread, event.graph, (unsigned long long)frame.number);
+			}
+		}
+	}
+	fprintf(file, "\n]}\n");
+	return fclose(file) == 0;
+}
+
+void ProfileScope::end()
+{
+	Profiler::record({ _name, _graph, 0, _start, Profiler::now() - _start });
+}
+
+GpuProfileScope::GpuProfileScope(const char* name, size_t graph)
+{
+	_query = 0;
+	if (!Profiler::Enabled() || gpuScopeOpen || !(GLEW_VERSION_3_3 || GLEW_ARB_timer_query)) return;
+
+	if (freeQueries.empty())
+	{
+		freeQueries.resize(16);
+		glGenQueries((GLsizei)freeQueries.size(), freeQueries.data());
+	}
+	_query = freeQueries.back();
+	freeQueries.pop_back();
+	glBeginQuery(GL_TIME_ELAPSED, _query);
+	gpuScopeOpen = true;
+	pendingQueries.push_back({ _query, frameNumber, { name, graph, -1, Profiler::now(), 0 } });
+}
+
+GpuProfileScope::~GpuProfileScope()
+{
+	if (_query == 0) return;
+	glEndQuery(GL_TIME_ELAPSED);
+	gpuScopeOpen = false;
+}
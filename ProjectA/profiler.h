@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include <glew.h>
+
+using std::string;
+
+/*
+Time span recorded by the profiler, in microseconds since the profiler started. GPU spans are placed at the time their
+commands were issued, the GPU only reports how long they took
+*/
+struct ProfileEvent
+{
+	const char* name; // Static string, spans of the same name are summed up together
+	size_t graph; // Graph the span worked on, 0 for none
+	int thread; // Small index of the recording thread, -1 for the GPU
+	double start;
+	double duration;
+};
+
+/*
+Frame profiler. CPU spans are timed with ProfileScope on any thread, GPU spans with GpuProfileScope on the GL thread,
+through a pool of GL_TIME_ELAPSED queries read back once their results are in, without stalling the pipeline
+Spans land in the frame they end in, the last history_frames frames are kept for the panel and for trace exports
+While disabled a scope costs one relaxed atomic load, nothing is recorded
+*/
+class Profiler
+{
+public:
+	static void SetEnabled(bool enabled);
+	static bool Enabled() { return _enabled.load(std::memory_order_relaxed); };
+	// Closes the previous frame and reads back finished GPU queries. GL thread only, once per frame
+	static void NewFrame();
+	// Histograms of the frames, of every span name and of the graphs. Within an ImGui frame
+	static void DrawPanel(bool* p_open);
+	// Writes the recorded frames as a Chrome trace-event JSON file (chrome://tracing, Perfetto). False if it can't
+	static bool ExportTrace(const string& path);
+
+	constexpr static size_t history_frames = 240;
+
+private:
+	friend class ProfileScope;
+	friend class GpuProfileScope;
+
+	static void record(const ProfileEvent& event);
+	static double now();
+
+	static std::atomic<bool> _enabled;
+};
+
+/*
+Times the CPU span from its construction to its destruction
+*/
+class ProfileScope
+{
+public:
+	explicit ProfileScope(const char* name, size_t graph = 0) :
+		_name(name), _graph(graph), _start(Profiler::Enabled() ? Profiler::now() : -1) {};
+	~ProfileScope() { if (_start >= 0) end(); };
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+	void end();
+
+	const char* _name;
+	size_t _graph;
+	double _start; // Negative while not recording
+};
+
+/*
+Times the GL commands issued from its construction to its destruction. GPU spans can't nest, the GL only runs one
+GL_TIME_ELAPSED query at a time, a span opened within another isn't timed. Without timer queries nothing is
+*/
+class GpuProfileScope
+{
+public:
+	explicit GpuProfileScope(const char* name, size_t graph = 0);
+	~GpuProfileScope();
+	GpuProfileScope(const GpuProfileScope&) = delete;
+	GpuProfileScope& operator=(const GpuProfileScope&) = delete;
+
+private:
+	GLuint _query; // 0 while not recording
+};
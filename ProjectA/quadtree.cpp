@@ -0,0 +1,150 @@
+#include "quadtree.h"
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+SurfaceQuadtree::SurfaceQuadtree(double extent, unsigned int patchSamples, unsigned int maxLevel) :
+	_extent(extent), _patchSamples(patchSamples), _maxLevel(maxLevel)
+{
+}
+
+static PatchId patchOf(uint64_t key)
+{
+	return { (unsigned int)(key >> 48), (unsigned int)(key >> 24) & 0xffffff, (unsigned int)key & 0xffffff };
+}
+
+bool SurfaceQuadtree::isLeaf(const std::unordered_set<uint64_t>& leaves, unsigned int level, long long i, long long j) const
+{
+	if (i < 0 || j < 0 || i >= (1ll << level) || j >= (1ll << level)) return false;
+	return leaves.count(PatchId{ level, (unsigned int)i, (unsigned int)j }.Key()) != 0;
+}
+
+/*
+Splits leaves until every leaf's neighbors are at most one level coarser
+*/
+void SurfaceQuadtree::balance(std::unordered_set<uint64_t>& leaves) const
+{
+	const int neighbors[4][2] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+
+	vector<PatchId> pending;
+	for (uint64_t key : leaves)
+	{
+		pending.push_back(patchOf(key));
+	}
+
+	while (!pending.empty())
+	{
+		PatchId patch = pending.back();
+		pending.pop_back();
+		if (!isLeaf(leaves, patch.level, patch.i, patch.j)) continue;
+
+		for (const int* offset : neighbors)
+		{
+			long long i = (long long)patch.i + offset[0], j = (long long)patch.j + offset[1];
+			if (i < 0 || j < 0 || i >= (1ll << patch.level) || j >= (1ll << patch.level)) continue;
+
+			// The leaf covering the neighbor, if it's two or more levels coarser
+			for (int level = (int)patch.level - 2; level >= 0; level--)
+			{
+				int shift = patch.level - level;
+				if (!isLeaf(leaves, level, i >> shift, j >> shift)) continue;
+
+				PatchId coarse = { (unsigned int)level, (unsigned int)(i >> shift), (unsigned int)(j >> shift) };
+				leaves.erase(coarse.Key());
+				for (unsigned int child = 0; child < 4; child++)
+				{
+					PatchId split = { coarse.level + 1, coarse.i * 2 + child / 2, coarse.j * 2 + child % 2 };
+					leaves.insert(split.Key());
+					pending.push_back(split);
+				}
+				// The patch itself is checked again against the new leaves
+				pending.push_back(patch);
+				break;
+			}
+		}
+	}
+}
+
+bool SurfaceQuadtree::Update(const LodCamera& camera, double pixelSize, size_t maxPatches, const PatchBounds& bounds)
+{
+	struct Candidate
+	{
+		double size; // Projected sample spacing, in pixels
+		bool splittable;
+		PatchId patch;
+		bool operator<(const Candidate& other) const { return size < other.size; };
+	};
+
+	auto candidate = [&](const PatchId& patch)
+	{
+		double lo = 0, hi = 0;
+		bool splittable = bounds(patch, lo, hi) && patch.level < _maxLevel;
+
+		// Distance from the camera to the patch's bounding box
+		double x0 = PatchX(patch), z0 = PatchZ(patch), side = PatchSide(patch.level);
+		double dx = std::max({ x0 - camera.x, camera.x - (x0 + side), 0.0 });
+		double dy = std::max({ lo - camera.y, camera.y - hi, 0.0 });
+		double dz = std::max({ z0 - camera.z, camera.z - (z0 + side), 0.0 });
+		double distance = std::max(sqrt(dx * dx + dy * dy + dz * dz), 1e-6);
+		return Candidate{ SampleSpacing(patch.level) * camera.pixelsPerUnit / distance, splittable, patch };
+	};
+
+	// Split the patch whose samples look largest until none is over pixelSize or the budget is spent, 3 more per split.
+	// Balancing splits some more, the budget shrinks by as many when that runs over
+	std::unordered_set<uint64_t> leaves;
+	size_t budget = maxPatches;
+	for (int attempt = 0; attempt < 4; attempt++)
+	{
+		leaves.clear();
+		std::priority_queue<Candidate> queue;
+		queue.push(candidate({ 0, 0, 0 }));
+		size_t patchCount = 1;
+		while (!queue.empty())
+		{
+			Candidate next = queue.top();
+			queue.pop();
+			if (!next.splittable || next.size <= pixelSize || patchCount + 3 > budget)
+			{
+				leaves.insert(next.patch.Key());
+				continue;
+			}
+
+			patchCount += 3;
+			for (unsigned int child = 0; child < 4; child++)
+			{
+				queue.push(candidate({ next.patch.level + 1, next.patch.i * 2 + child / 2, next.patch.j * 2 + child % 2 }));
+			}
+		}
+		balance(leaves);
+
+		if (leaves.size() <= maxPatches || budget <= leaves.size() - maxPatches) break;
+		budget -= leaves.size() - maxPatches;
+	}
+
+	vector<uint64_t> keys(leaves.begin(), leaves.end());
+	std::sort(keys.begin(), keys.end());
+	vector<PatchId> sorted;
+	sorted.reserve(keys.size());
+	for (uint64_t key : keys)
+	{
+		sorted.push_back(patchOf(key));
+	}
+
+	bool changed = sorted.size() != _leaves.size() || !std::equal(sorted.begin(), sorted.end(), _leaves.begin(),
+		[](const PatchId& a, const PatchId& b) { return a.Key() == b.Key(); });
+	if (!changed) return false;
+
+	_leaves = std::move(sorted);
+	_coarserEdges.assign(_leaves.size(), 0);
+	for (size_t k = 0; k < _leaves.size(); k++)
+	{
+		const PatchId& p = _leaves[k];
+		if (p.level == 0) continue;
+		auto coarser = [&](long long i, long long j) { return isLeaf(leaves, p.level - 1, i >> 1, j >> 1); };
+		if (p.j > 0 && coarser(p.i, (long long)p.j - 1)) _coarserEdges[k] |= EDGE_LOW_X;
+		if (p.j + 1 < (1u << p.level) && coarser(p.i, p.j + 1)) _coarserEdges[k] |= EDGE_HIGH_X;
+		if (p.i > 0 && coarser((long long)p.i - 1, p.j)) _coarserEdges[k] |= EDGE_LOW_Z;
+		if (p.i + 1 < (1u << p.level) && coarser(p.i + 1, p.j)) _coarserEdges[k] |= EDGE_HIGH_Z;
+	}
+	return true;
+}
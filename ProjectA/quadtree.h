@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+
+using std::vector;
+
+/*
+Square patch of a quadtree, level 0 is the whole tree and every level halves the side of its patches
+i and j are the patch's row (along z) and column (along x) within its level
+*/
+struct PatchId
+{
+	unsigned int level;
+	unsigned int i, j;
+
+	uint64_t Key() const { return ((uint64_t)level << 48) | ((uint64_t)i << 24) | j; };
+};
+
+// Edges of a patch, as bits
+enum patchEdges
+{
+	EDGE_LOW_X = 1, EDGE_HIGH_X = 2, EDGE_LOW_Z = 4, EDGE_HIGH_Z = 8
+};
+
+/*
+Point of view patches are refined for, in the units of the tree
+*/
+struct LodCamera
+{
+	double x, y, z;
+	double pixelsPerUnit; // On-screen size of a unit at a distance of one unit
+};
+
+/*
+Restricted quadtree over a square, picking the patches a surface is drawn with from the camera
+Patches are split while their samples project larger than a target size on screen, the largest first, until a patch
+budget runs out. Neighboring leaves then differ by one level at most, and the finer one of the two snaps its samples
+on the shared edge to the coarser one's, so no cracks open between them
+*/
+class SurfaceQuadtree
+{
+public:
+	// Gives the height range of a patch, returns false if the patch shouldn't be split (e.g. it's flat or not drawn)
+	typedef std::function<bool(const PatchId& patch, double& lo, double& hi)> PatchBounds;
+
+	// The tree covers [-extent, extent] along x and z, its patches hold "patchSamples" quads a side
+	SurfaceQuadtree(double extent, unsigned int patchSamples, unsigned int maxLevel);
+
+	// Picks the leaves for "camera", returns true if they changed
+	bool Update(const LodCamera& camera, double pixelSize, size_t maxPatches, const PatchBounds& bounds);
+
+	const vector<PatchId>& Leaves() const { return _leaves; };
+	// Edges of leaf "leaf" shared with a coarser leaf, as patchEdges
+	unsigned int CoarserEdges(size_t leaf) const { return _coarserEdges[leaf]; };
+
+	double PatchSide(unsigned int level) const { return 2 * _extent / (1u << level); };
+	double SampleSpacing(unsigned int level) const { return PatchSide(level) / _patchSamples; };
+	double PatchX(const PatchId& patch) const { return -_extent + patch.j * PatchSide(patch.level); };
+	double PatchZ(const PatchId& patch) const { return -_extent + patch.i * PatchSide(patch.level); };
+	unsigned int PatchSamples() const { return _patchSamples; };
+
+private:
+	void balance(std::unordered_set<uint64_t>& leaves) const;
+	bool isLeaf(const std::unordered_set<uint64_t>& leaves, unsigned int level, long long i, long long j) const;
+
+	double _extent;
+	unsigned int _patchSamples;
+	unsigned int _maxLevel;
+	vector<PatchId> _leaves; // Ordered by key
+	vector<unsigned int> _coarserEdges;
+};
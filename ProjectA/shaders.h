@@ -1,15 +1,19 @@
 
 
-//vertex shader w/ two rotation matricies stored, plus color grading
-const char* vertex_shader = "\
+//vertex shader w/ two rotation matricies stored, plus color grading, passes the rotated normals on for lighting
+const char* const vertex_shader = "\
 #version 330\n\
 layout(location = 0) in vec3 position;\
+layout(location = 1) in vec3 normal;\
 uniform vec3 offset;\
 uniform mat4 perspective;\
 uniform vec2 angle;\
 uniform vec4 color;\
 uniform bool isGradient;\
 smooth out vec4 theColor;\
+smooth out vec3 theNormal;\
+smooth out vec3 viewPosition;\
+smooth out float defined;\
 void main(){\
   mat4 xRMatrix = mat4(cos(angle.x), 0.0, sin(angle.x), 0.0,\
                         0.0, 1.0, 0.0, 0.0,\
@@ -22,17 +26,151 @@ void main(){\
   vec4 rotatedPosition = vec4( position.xyz, 1.0f ) * xRMatrix * yRMatrix;\
   vec4 cameraPos = rotatedPosition + vec4(offset.x, offset.y, offset.z, 0.0);\
   gl_Position = perspective * cameraPos;\
+  theNormal = (vec4(normal, 0.0) * xRMatrix * yRMatrix).xyz;\
+  viewPosition = cameraPos.xyz;\
+  defined = 1.0;\
   if (isGradient) theColor = mix(vec4(color.x, color.y, color.z, color.a), vec4(color.x + (1-color.x)/2, color.y + (1-color.y)/2, color.z + (1-color.z)/2, color.a), abs(position.y) / 100);\
   else theColor = color;\
 }";
 
 
-// defualt fragment shader
-const char* fragment_shader = "\
+// vertex shader variant for graphs generated on the CPU, which store nothing but heights and slopes. x/z are those of
+// sample gl_VertexID % (patchSide^2) of patch gl_VertexID / (patchSide^2), whose first sample and spacing come from the
+// patches texture. Quantized heights map 0-65534 onto heightBias + height * heightScale, 65535 marks undefined samples
+// Graph programs share the camera in the GraphView block, GraphStyle holds a graph's surface, z and x outline colors,
+// of which part picks the one drawn. They're always color graded
+const char* const heightfield_vertex_shader = "\
+#version 330\n\
+layout(location = 0) in float height;\
+layout(location = 1) in vec2 slope;\
+layout(std140) uniform GraphView { mat4 perspective; vec3 offset; vec2 angle; };\
+layout(std140) uniform GraphStyle { vec4 colors[3]; };\
+uniform int part;\
+uniform samplerBuffer patches;\
+uniform int patchSide;\
+uniform bool quantized;\
+uniform float heightScale;\
+uniform float heightBias;\
+smooth out vec4 theColor;\
+smooth out vec3 theNormal;\
+smooth out vec3 viewPosition;\
+smooth out float defined;\
+void main(){\
+  int patchVertices = patchSide * patchSide;\
+  vec4 origin = texelFetch(patches, gl_VertexID / patchVertices);\
+  int index = gl_VertexID % patchVertices;\
+  vec2 grid = origin.xy + vec2(index % patchSide, index / patchSide) * origin.z;\
+  if (quantized) defined = height < 65535.0 ? 1.0 : 0.0;\
+  else defined = (isnan(height) || isinf(height)) ? 0.0 : 1.0;\
+  float y = defined > 0.0 ? (quantized ? heightBias + height * heightScale : height) : 0.0;\
+  vec3 position = vec3(grid.x, y, grid.y);\
+  vec3 normal = vec3(slope.x, 1.0, slope.y);\
+  mat4 xRMatrix = mat4(cos(angle.x), 0.0, sin(angle.x), 0.0,\
+                        0.0, 1.0, 0.0, 0.0,\
+                        -sin(angle.x), 0.0, cos(angle.x), 0.0,\
+                        0.0, 0.0, 0.0, 1.0);\
+  mat4 yRMatrix = mat4(1.0, 0.0, 0.0, 0.0,\
+                  0.0, cos(angle.y), -sin(angle.y), 0.0,\
+                  0.0, sin(angle.y), cos(angle.y), 0.0,\
+                  0.0, 0.0, 0.0, 1.0);\
+  vec4 rotatedPosition = vec4( position.xyz, 1.0f ) * xRMatrix * yRMatrix;\
+  vec4 cameraPos = rotatedPosition + vec4(offset.x, offset.y, offset.z, 0.0);\
+  gl_Position = perspective * cameraPos;\
+  theNormal = (vec4(normal, 0.0) * xRMatrix * yRMatrix).xyz;\
+  viewPosition = cameraPos.xyz;\
+  vec4 color = colors[part];\
+  theColor = mix(vec4(color.x, color.y, color.z, color.a), vec4(color.x + (1-color.x)/2, color.y + (1-color.y)/2, color.z + (1-color.z)/2, color.a), abs(position.y) / 100);\
+}";
+
+
+// vertex shader variant evaluating the graph's equation itself, on x/z taken from a grid shared by all graphs scaled by
+// sampleSize. The grid is a tile drawn instanced, each instance at the corner it reads from tiles (on the first texture
+// unit, samplers default to it). The equation's GLSL function, vec3 graph_equation(x, z) giving (y, dy/dx, dy/dz), is spliced in between
+// head and main. The eq_ functions carry the derivatives along (dual numbers) and follow the C library on invalid inputs
+const char* const equation_vertex_shader_head = "\
+#version 330\n\
+layout(location = 0) in vec2 tileGrid;\
+uniform samplerBuffer tiles;\
+layout(std140) uniform GraphView { mat4 perspective; vec3 offset; vec2 angle; };\
+layout(std140) uniform GraphStyle { vec4 colors[3]; };\
+uniform int part;\
+uniform float sampleSize;\
+smooth out vec4 theColor;\
+smooth out vec3 theNormal;\
+smooth out vec3 viewPosition;\
+smooth out float defined;\
+float eq_nan() { return uintBitsToFloat(0x7fc00000u); }\
+float eq_inf() { return uintBitsToFloat(0x7f800000u); }\
+float eq_powf(float a, float b){\
+  if (b == 0.0) return 1.0;\
+  if (a == 0.0) return b > 0.0 ? 0.0 : eq_inf();\
+  float p = pow(abs(a), b);\
+  if (!(a < 0.0)) return p;\
+  if (floor(b) != b) return eq_nan();\
+  return mod(b, 2.0) == 0.0 ? p : -p;\
+}\
+float eq_logf(float a) { return a > 0.0 ? log(a) : (a == 0.0 ? -eq_inf() : eq_nan()); }\
+vec3 eq_dual(float v, float da, vec3 a) { return vec3(v, da * a.yz); }\
+vec3 eq_dual(float v, float da, vec3 a, float db, vec3 b) { return vec3(v, da * a.yz + mix(vec2(0.0), db * b.yz, notEqual(b.yz, vec2(0.0)))); }\
+vec3 eq_add(vec3 a, vec3 b) { return eq_dual(a.x + b.x, 1.0, a, 1.0, b); }\
+vec3 eq_sub(vec3 a, vec3 b) { return eq_dual(a.x - b.x, 1.0, a, -1.0, b); }\
+vec3 eq_mul(vec3 a, vec3 b) { return eq_dual(a.x * b.x, b.x, a, a.x, b); }\
+vec3 eq_div(vec3 a, vec3 b) { return eq_dual(a.x / b.x, 1.0 / b.x, a, -(a.x / b.x) / b.x, b); }\
+vec3 eq_pow(vec3 a, vec3 b) { float v = eq_powf(a.x, b.x); return eq_dual(v, b.x * eq_powf(a.x, b.x - 1.0), a, v * eq_logf(a.x), b); }\
+vec3 eq_cos(vec3 a) { return eq_dual(cos(a.x), -sin(a.x), a); }\
+vec3 eq_sin(vec3 a) { return eq_dual(sin(a.x), cos(a.x), a); }\
+vec3 eq_tan(vec3 a) { float v = tan(a.x); return eq_dual(v, 1.0 + v * v, a); }\
+vec3 eq_acos(vec3 a) { return eq_dual(abs(a.x) <= 1.0 ? acos(a.x) : eq_nan(), -1.0 / sqrt(1.0 - a.x * a.x), a); }\
+vec3 eq_asin(vec3 a) { return eq_dual(abs(a.x) <= 1.0 ? asin(a.x) : eq_nan(), 1.0 / sqrt(1.0 - a.x * a.x), a); }\
+vec3 eq_atan(vec3 a) { return eq_dual(atan(a.x), 1.0 / (1.0 + a.x * a.x), a); }\
+vec3 eq_log(vec3 a) { return eq_dual(eq_logf(a.x), 1.0 / a.x, a); }\
+";
+
+const char* const equation_vertex_shader_main = "\
+void main(){\
+  vec2 grid = tileGrid + texelFetch(tiles, gl_InstanceID).xy;\
+  vec3 y = graph_equation(grid.x * sampleSize, grid.y * sampleSize);\
+  defined = (isnan(y.x) || isinf(y.x)) ? 0.0 : 1.0;\
+  vec3 position = vec3(grid.x, defined > 0.0 ? y.x : 0.0, grid.y);\
+  vec2 slope = -y.yz * sampleSize;\
+  vec3 normal = (any(isnan(slope)) || any(isinf(slope))) ? vec3(0.0, 1.0, 0.0) : vec3(slope.x, 1.0, slope.y);\
+  mat4 xRMatrix = mat4(cos(angle.x), 0.0, sin(angle.x), 0.0,\
+                        0.0, 1.0, 0.0, 0.0,\
+                        -sin(angle.x), 0.0, cos(angle.x), 0.0,\
+                        0.0, 0.0, 0.0, 1.0);\
+  mat4 yRMatrix = mat4(1.0, 0.0, 0.0, 0.0,\
+                  0.0, cos(angle.y), -sin(angle.y), 0.0,\
+                  0.0, sin(angle.y), cos(angle.y), 0.0,\
+                  0.0, 0.0, 0.0, 1.0);\
+  vec4 rotatedPosition = vec4( position.xyz, 1.0f ) * xRMatrix * yRMatrix;\
+  vec4 cameraPos = rotatedPosition + vec4(offset.x, offset.y, offset.z, 0.0);\
+  gl_Position = perspective * cameraPos;\
+  theNormal = (vec4(normal, 0.0) * xRMatrix * yRMatrix).xyz;\
+  viewPosition = cameraPos.xyz;\
+  vec4 color = colors[part];\
+  theColor = mix(vec4(color.x, color.y, color.z, color.a), vec4(color.x + (1-color.x)/2, color.y + (1-color.y)/2, color.z + (1-color.z)/2, color.a), abs(position.y) / 100);\
+}";
+
+
+// defualt fragment shader, diffuse/specular lit variant (light fixed to the camera) when isLit is set
+// drops fragments of triangles touching samples where the equation is undefined
+const char* const fragment_shader = "\
 #version 330\n\
 smooth in vec4 theColor;\
+smooth in vec3 theNormal;\
+smooth in vec3 viewPosition;\
+smooth in float defined;\
+uniform bool isLit;\
 out vec4 outputColor;\
 void main(){\
-  outputColor = theColor;\
+  if (defined < 0.999) discard;\
+  if (!isLit) { outputColor = theColor; return; }\
+  vec3 lightDir = normalize(vec3(0.3, 1.0, 0.5));\
+  vec3 viewDir = normalize(-viewPosition);\
+  vec3 n = normalize(theNormal);\
+  if (dot(n, viewDir) < 0.0) n = -n;\
+  float diffuse = max(dot(n, lightDir), 0.0);\
+  float specular = pow(max(dot(n, normalize(lightDir + viewDir)), 0.0), 32.0);\
+  outputColor = vec4(theColor.rgb * (0.3 + 0.7 * diffuse) + vec3(0.3 * specular), theColor.a);\
 }";
 
@@ -0,0 +1,101 @@
+#include "simd.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC accepts any intrinsic regardless of the compile target, GCC and Clang need the target per function
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+#define SCALAR_KERNEL(name, op) \
+static void name##Scalar(double* dst, const double* a, const double* b, size_t count) \
+{ \
+	for (size_t i = 0; i < count; i++) dst[i] = a[i] op b[i]; \
+}
+
+SCALAR_KERNEL(add, +)
+SCALAR_KERNEL(sub, -)
+SCALAR_KERNEL(mul, *)
+SCALAR_KERNEL(div, /)
+
+#ifdef SIMD_X86
+
+#define AVX2_KERNEL(name, op, intrinsic) \
+static TARGET_AVX2 void name##Avx2(double* dst, const double* a, const double* b, size_t count) \
+{ \
+	size_t i = 0; \
+	for (; i + 4 <= count; i += 4) \
+		_mm256_storeu_pd(dst + i, intrinsic(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i))); \
+	for (; i < count; i++) dst[i] = a[i] op b[i]; \
+}
+
+#define AVX512_KERNEL(name, op, intrinsic) \
+static TARGET_AVX512 void name##Avx512(double* dst, const double* a, const double* b, size_t count) \
+{ \
+	size_t i = 0; \
+	for (; i + 8 <= count; i += 8) \
+		_mm512_storeu_pd(dst + i, intrinsic(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i))); \
+	for (; i < count; i++) dst[i] = a[i] op b[i]; \
+}
+
+AVX2_KERNEL(add, +, _mm256_add_pd)
+AVX2_KERNEL(sub, -, _mm256_sub_pd)
+AVX2_KERNEL(mul, *, _mm256_mul_pd)
+AVX2_KERNEL(div, /, _mm256_div_pd)
+
+AVX512_KERNEL(add, +, _mm512_add_pd)
+AVX512_KERNEL(sub, -, _mm512_sub_pd)
+AVX512_KERNEL(mul, *, _mm512_mul_pd)
+AVX512_KERNEL(div, /, _mm512_div_pd)
+
+/*
+Returns whether the CPU and OS support AVX2 (avx512 = false) or AVX-512F (avx512 = true)
+*/
+static bool cpuSupports(bool avx512)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+
+	// The OS has to save the wide registers on context switches
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28))) return false;
+	unsigned long long osState = _xgetbv(0);
+	if ((osState & 0x6) != 0x6) return false;
+	if (avx512 && (osState & 0xE0) != 0xE0) return false;
+
+	__cpuidex(info, 7, 0);
+	return avx512 ? (info[1] & (1 << 16)) != 0 : (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return avx512 ? __builtin_cpu_supports("avx512f") : __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+static BatchKernels selectKernels()
+{
+#ifdef SIMD_X86
+	if (cpuSupports(true)) return { addAvx512, subAvx512, mulAvx512, divAvx512, "AVX-512" };
+	if (cpuSupports(false)) return { addAvx2, subAvx2, mulAvx2, divAvx2, "AVX2" };
+#endif
+	return { addScalar, subScalar, mulScalar, divScalar, "Scalar" };
+}
+
+const BatchKernels& GetBatchKernels()
+{
+	static const BatchKernels kernels = selectKernels();
+	return kernels;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+
+/*
+Element-wise kernels over arrays of doubles, used by batched equation evaluation
+The widest instruction set supported by the running CPU is picked once at startup, with a scalar fallback
+*/
+struct BatchKernels
+{
+	void (*add)(double* dst, const double* a, const double* b, size_t count);
+	void (*sub)(double* dst, const double* a, const double* b, size_t count);
+	void (*mul)(double* dst, const double* a, const double* b, size_t count);
+	void (*div)(double* dst, const double* a, const double* b, size_t count);
+	const char* name;
+};
+
+const BatchKernels& GetBatchKernels();
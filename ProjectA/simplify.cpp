@@ -0,0 +1,179 @@
+#include "parsing.h"
+#include <cmath>
+
+// Largest integer exponent that is expanded into a chain of multiplications
+constexpr double maxExpandedPower = 8;
+
+static bool isConstant(const EquationTree& tree, nodeIndex node)
+{
+	return tree.Node(node)._op == OP_CONST;
+}
+
+static bool isConstant(const EquationTree& tree, nodeIndex node, double value)
+{
+	return isConstant(tree, node) && tree.Node(node)._value == value;
+}
+
+/*
+Builds base^exponent out of multiplications by repeated squaring, so x^8 costs 3 multiplications
+Every multiplication shares its operands instead of copying them
+*/
+static nodeIndex expandPower(EquationTree& tree, nodeIndex base, unsigned int exponent)
+{
+	if (exponent == 1) return base;
+
+	nodeIndex half = expandPower(tree, base, exponent / 2);
+	nodeIndex square = tree.AddOperation(OP_MUL, half, half);
+	if (exponent % 2 == 0) return square;
+	return tree.AddOperation(OP_MUL, square, base);
+}
+
+static nodeIndex simplifyOperation(EquationTree& tree, opCodes op, nodeIndex left, nodeIndex right);
+
+/*
+Merges the constants of nested additions/multiplications: (a + c1) + c2 -> a + (c1 + c2)
+Expects the constant operand of the node, and of its child, to already be on the right
+*/
+static nodeIndex gatherConstants(EquationTree& tree, opCodes op, nodeIndex left, nodeIndex right)
+{
+	EquationNode inner = tree.Node(left);
+	if (!isConstant(tree, right) || inner._op != op || !isConstant(tree, inner._right))
+		return tree.AddOperation(op, left, right);
+
+	double c1 = tree.Node(inner._right)._value;
+	double c2 = tree.Node(right)._value;
+	double merged = op == OP_ADD ? c1 + c2 : c1 * c2;
+	return simplifyOperation(tree, op, inner._left, tree.AddConstant(merged));
+}
+
+/*
+Adds op(left, right) to the tree, where both operands are already simplified
+Nodes dropped by a simplification stay unused in the arena until the tree is released
+*/
+static nodeIndex simplifyOperation(EquationTree& tree, opCodes op, nodeIndex left, nodeIndex right)
+{
+	// Constant folding, constant subtrees read no variables
+	if (isConstant(tree, left) && (right == noNode || isConstant(tree, right)))
+		return tree.AddConstant(ApplyOperation(op, tree.Node(left)._value, right != noNode ? tree.Node(right)._value : 0));
+
+	// Keep the constant operand of commutative operations on the right
+	if ((op == OP_ADD || op == OP_MUL) && isConstant(tree, left))
+		std::swap(left, right);
+
+	switch (op)
+	{
+	case OP_ADD:
+	{
+		if (isConstant(tree, right, 0)) return left;
+		return gatherConstants(tree, op, left, right);
+	}
+	case OP_SUB:
+	{
+		if (isConstant(tree, right, 0)) return left;
+		break;
+	}
+	case OP_MUL:
+	{
+		if (isConstant(tree, right, 0)) return tree.AddConstant(0);
+		if (isConstant(tree, right, 1)) return left;
+		return gatherConstants(tree, op, left, right);
+	}
+	case OP_DIV:
+	{
+		if (isConstant(tree, right, 1)) return left;
+		if (isConstant(tree, right) && tree.Node(right)._value != 0)
+		{
+			nodeIndex reciprocal = tree.AddConstant(1 / tree.Node(right)._value);
+			return simplifyOperation(tree, OP_MUL, left, reciprocal);
+		}
+		break;
+	}
+	case OP_POW:
+	{
+		if (isConstant(tree, right, 0)) return tree.AddConstant(1);
+		if (isConstant(tree, right, 1)) return left;
+
+		double exponent = tree.Node(right)._value;
+		if (isConstant(tree, right) && exponent == floor(exponent) && exponent > 1 && exponent <= maxExpandedPower)
+		{
+			return expandPower(tree, left, (unsigned int)exponent);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	return tree.AddOperation(op, left, right);
+}
+
+/*
+Copies the reachable part of a tree into a new arena, simplifying it on the way
+Nodes shared in the source tree stay shared
+*/
+class TreeSimplifier
+{
+public:
+	TreeSimplifier(const EquationTree& source) : _source(source), _simplified(source.ArenaSize(), noNode) {};
+
+	EquationTree Simplify()
+	{
+		_tree.Reserve(_source.ArenaSize());
+		_tree.SetRoot(simplify(_source.Root()));
+		return std::move(_tree);
+	}
+
+private:
+	nodeIndex simplify(nodeIndex index)
+	{
+		if (_simplified[index] != noNode) return _simplified[index];
+
+		const EquationNode& node = _source.Node(index);
+		nodeIndex result;
+		if (node._op == OP_CONST) result = _tree.AddConstant(node._value);
+		else if (node._op == OP_VAR) result = _tree.AddVariable(node._var);
+		else
+		{
+			nodeIndex left = simplify(node._left);
+			nodeIndex right = node._right != noNode ? simplify(node._right) : noNode;
+			result = simplifyOperation(_tree, node._op, left, right);
+		}
+
+		_simplified[index] = result;
+		return result;
+	}
+
+	const EquationTree& _source;
+	EquationTree _tree;
+	vector<nodeIndex> _simplified; // Node of the new tree for every source node, noNode until visited
+};
+
+/*
+Folds constant subtrees and applies algebraic identities (x+0, x*1, x*0, x^1, ...)
+Small integer powers become multiplications and division by a constant becomes multiplication
+Note that x*0 is folded to 0 even where x itself is undefined
+*/
+EquationTree SimplifyEquationTree(const EquationTree& tree)
+{
+	TreeSimplifier simplifier(tree);
+	return simplifier.Simplify();
+}
+
+/*
+Children always come before their parents in the arena, so one pass over it counts every subtree,
+without walking shared nodes once per parent
+*/
+size_t CountEquationNodes(const EquationTree& tree)
+{
+	if (tree.Empty()) return 0;
+
+	vector<size_t> counts(tree.ArenaSize());
+	for (nodeIndex i = 0; i < tree.ArenaSize(); i++)
+	{
+		const EquationNode& node = tree.Node(i);
+		counts[i] = 1;
+		if (node._left != noNode) counts[i] += counts[node._left];
+		if (node._right != noNode) counts[i] += counts[node._right];
+	}
+	return counts[tree.Root()];
+}
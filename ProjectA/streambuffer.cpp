@@ -0,0 +1,133 @@
+#include "streambuffer.h"
+
+// How long a single wait on a fence lasts before checking again, in nanoseconds
+constexpr GLuint64 fenceTimeout = 1000000;
+
+bool StreamBuffer::Persistent()
+{
+	return GLEW_ARB_buffer_storage;
+}
+
+StreamBuffer::StreamBuffer(StreamBuffer&& other) noexcept :
+	_buffer(other._buffer), _size(other._size), _persistent(other._persistent), _mapped(other._mapped),
+	_drawnRegion(other._drawnRegion), _writtenRegion(other._writtenRegion)
+{
+	_fences[0] = other._fences[0];
+	_fences[1] = other._fences[1];
+	other._buffer = 0;
+	other._size = 0;
+	other._mapped = nullptr;
+	other._fences[0] = other._fences[1] = nullptr;
+}
+
+StreamBuffer::~StreamBuffer()
+{
+	release();
+}
+
+void StreamBuffer::release()
+{
+	for (GLsync& fence : _fences)
+	{
+		if (fence != nullptr) glDeleteSync(fence);
+		fence = nullptr;
+	}
+	if (_buffer == 0) return;
+
+	if (_mapped != nullptr)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		_mapped = nullptr;
+	}
+	glDeleteBuffers(1, &_buffer);
+	_buffer = 0;
+	_size = 0;
+}
+
+void StreamBuffer::waitFence(int region)
+{
+	GLsync& fence = _fences[region];
+	if (fence == nullptr) return;
+
+	// Usually signaled long ago, the region was last drawn before the other one replaced it
+	while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, fenceTimeout) == GL_TIMEOUT_EXPIRED);
+	glDeleteSync(fence);
+	fence = nullptr;
+}
+
+void* StreamBuffer::Map(size_t size)
+{
+	if (size != _size)
+	{
+		release();
+		_persistent = Persistent();
+		_drawnRegion = 0;
+
+		glGenBuffers(1, &_buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+		if (_persistent)
+		{
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glBufferStorage(GL_ARRAY_BUFFER, 2 * size, nullptr, flags);
+			_mapped = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, 2 * size, flags);
+			if (_mapped == nullptr)
+			{
+				release();
+				return nullptr;
+			}
+		}
+		else
+		{
+			glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+		}
+		_size = size;
+	}
+
+	if (_persistent)
+	{
+		_writtenRegion = 1 - _drawnRegion;
+		waitFence(_writtenRegion);
+		return _mapped + _writtenRegion * _size;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+	return glMapBufferRange(GL_ARRAY_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+}
+
+/*
+Until Unmap the written region stays the same, so the next Map hands out what was reserved
+*/
+void* StreamBuffer::Reserve(size_t size)
+{
+	if (!_persistent || _mapped == nullptr || size != _size) return nullptr;
+	return Map(size);
+}
+
+bool StreamBuffer::Unmap()
+{
+	if (_persistent)
+	{
+		// The mapping is coherent, writes are seen by every command issued from now on
+		_drawnRegion = _writtenRegion;
+		return true;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+	return glUnmapBuffer(GL_ARRAY_BUFFER) == GL_TRUE;
+}
+
+void StreamBuffer::BindAttribute(GLuint attribute, GLint components, GLenum type) const
+{
+	glBindBuffer(GL_ARRAY_BUFFER, _buffer);
+	glVertexAttribPointer(attribute, components, type, GL_FALSE, 0, (void*)(_drawnRegion * _size));
+}
+
+void StreamBuffer::Fence()
+{
+	if (!_persistent || _buffer == 0) return;
+
+	GLsync& fence = _fences[_drawnRegion];
+	if (fence != nullptr) glDeleteSync(fence);
+	fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
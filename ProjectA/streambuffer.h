@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+
+#include <glew.h>
+
+/*
+Vertex buffer kept for the lifetime of its owner and written through a mapping, with no staging copy on the CPU
+With ARB_buffer_storage the storage is mapped once, persistently, and split into two regions written in turn. The region
+being drawn is never written, and a fence placed after its last draw guards a region before it's written again
+Otherwise every write maps the buffer with invalidation, so the driver can hand out fresh storage instead of waiting on the GPU
+The storage is only reallocated when the written size changes
+*/
+class StreamBuffer
+{
+public:
+	StreamBuffer() = default;
+	~StreamBuffer();
+	StreamBuffer(StreamBuffer&& other) noexcept;
+	StreamBuffer(const StreamBuffer&) = delete;
+	StreamBuffer& operator=(const StreamBuffer&) = delete;
+	StreamBuffer& operator=(StreamBuffer&&) = delete;
+
+	// Starts writing "size" bytes, returns null if the buffer couldn't be mapped
+	// Map and Unmap are GL thread only, the mapped memory itself can be written from any thread in between
+	void* Map(size_t size);
+	// Region the next Map of "size" bytes returns, for a job to write into ahead of it from another thread. Null unless
+	// the buffer is persistently mapped with that size already. GL thread only, waits for the GPU to be done with it
+	void* Reserve(size_t size);
+	// Ends the write and draws from it from now on, returns false if the contents were lost and have to be written again
+	bool Unmap();
+	// Points vertex attribute "attribute" at the drawn contents, read as floats converted from "type"
+	void BindAttribute(GLuint attribute, GLint components, GLenum type = GL_FLOAT) const;
+	// Marks the drawn contents as in use by the draws issued so far
+	void Fence();
+
+	static bool Persistent();
+
+private:
+	void release();
+	void waitFence(int region);
+
+	GLuint _buffer = 0;
+	size_t _size = 0; // Bytes per region
+	bool _persistent = false;
+	char* _mapped = nullptr; // Persistent mapping of both regions
+	int _drawnRegion = 0;
+	int _writtenRegion = 0;
+	GLsync _fences[2] = { nullptr, nullptr };
+};
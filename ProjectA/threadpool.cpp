@@ -0,0 +1,155 @@
+#include "threadpool.h"
+#include <algorithm>
+
+// Pool and queue of the worker running on this thread, if any
+static thread_local const ThreadPool* workerPool = nullptr;
+static thread_local size_t workerQueue = 0;
+
+size_t ThreadPool::DefaultThreadCount()
+{
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+ThreadPool::ThreadPool(size_t threadCount)
+{
+	threadCount = std::max<size_t>(threadCount, 1);
+	for (size_t i = 0; i < threadCount; i++)
+	{
+		_queues.emplace_back(new TaskQueue);
+	}
+	for (size_t i = 0; i + 1 < threadCount; i++)
+	{
+		_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_sleepMutex);
+		_stopping = true;
+	}
+	_wake.notify_all();
+	for (std::thread& worker : _workers)
+	{
+		worker.join();
+	}
+}
+
+size_t ThreadPool::currentQueue() const
+{
+	return workerPool == this ? workerQueue : _queues.size() - 1;
+}
+
+void ThreadPool::Submit(TaskGroup& group, std::function<void()> task)
+{
+	group._pending.fetch_add(1, std::memory_order_relaxed);
+
+	TaskQueue& queue = *_queues[currentQueue()];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back({ std::move(task), &group });
+	}
+	_queuedTasks.fetch_add(1, std::memory_order_release);
+
+	// Taking the lock orders this against a worker that is about to sleep, so the notification can't be lost
+	{
+		std::lock_guard<std::mutex> lock(_sleepMutex);
+	}
+	_wake.notify_one();
+}
+
+/*
+Takes the newest task of "queue", or else the oldest task of any other queue
+*/
+bool ThreadPool::takeTask(size_t queue, Task& task)
+{
+	if (_queuedTasks.load(std::memory_order_acquire) == 0) return false;
+
+	for (size_t i = 0; i < _queues.size(); i++)
+	{
+		size_t victim = (queue + i) % _queues.size();
+		TaskQueue& q = *_queues[victim];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		if (q.tasks.empty()) continue;
+
+		if (i == 0)
+		{
+			task = std::move(q.tasks.back());
+			q.tasks.pop_back();
+		}
+		else
+		{
+			task = std::move(q.tasks.front());
+			q.tasks.pop_front();
+		}
+		_queuedTasks.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::run(Task& task)
+{
+	task.func();
+	if (task.group->_pending.fetch_sub(1, std::memory_order_release) > 1) return;
+
+	// Wakes the threads sleeping in Wait, the group may be gone once they return so it isn't touched again
+	{
+		std::lock_guard<std::mutex> lock(_sleepMutex);
+	}
+	_wake.notify_all();
+}
+
+void ThreadPool::workerLoop(size_t queue)
+{
+	workerPool = this;
+	workerQueue = queue;
+
+	while (true)
+	{
+		Task task;
+		if (takeTask(queue, task))
+		{
+			run(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(_sleepMutex);
+		_wake.wait(lock, [this]() { return _stopping || _queuedTasks.load(std::memory_order_acquire) > 0; });
+		if (_stopping) return;
+	}
+}
+
+/*
+Once nothing is left to take, the group's last tasks are running on other threads. The waiting thread sleeps with the
+workers then, woken by new tasks to help with or by a group finishing
+*/
+void ThreadPool::Wait(TaskGroup& group)
+{
+	size_t queue = currentQueue();
+	while (!group.Done())
+	{
+		Task task;
+		if (takeTask(queue, task))
+		{
+			run(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(_sleepMutex);
+		_wake.wait(lock, [this, &group]() { return group.Done() || _queuedTasks.load(std::memory_order_acquire) > 0; });
+	}
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t grain, const std::function<void(size_t begin, size_t end)>& func)
+{
+	grain = std::max<size_t>(grain, 1);
+	TaskGroup group;
+	for (size_t begin = 0; begin < count; begin += grain)
+	{
+		size_t end = std::min(begin + grain, count);
+		Submit(group, [&func, begin, end]() { func(begin, end); });
+	}
+	Wait(group);
+}
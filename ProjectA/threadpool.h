@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::vector;
+using std::unique_ptr;
+
+/*
+Tasks submitted together, waited on as a whole with ThreadPool::Wait
+*/
+class TaskGroup
+{
+public:
+	TaskGroup() = default;
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	bool Done() const { return _pending.load(std::memory_order_acquire) == 0; };
+
+private:
+	friend class ThreadPool;
+
+	std::atomic<size_t> _pending{ 0 };
+};
+
+/*
+Work stealing thread pool. Every worker owns a task queue, it runs its own tasks newest first and once it runs out,
+steals the oldest task of another queue. Threads outside of the pool share one more queue
+A thread waiting on a group runs queued tasks meanwhile, so tasks can themselves submit and wait on other tasks, and
+sleeps once there are none
+*/
+class ThreadPool
+{
+public:
+	// "threadCount" includes the thread waiting on the work, a pool of one thread runs everything on the waiting thread
+	explicit ThreadPool(size_t threadCount = DefaultThreadCount());
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void Submit(TaskGroup& group, std::function<void()> task);
+	// Returns once every task of the group has finished
+	void Wait(TaskGroup& group);
+	// Calls func(begin, end) on ranges of up to "grain" items covering [0, count), and waits for all of them
+	void ParallelFor(size_t count, size_t grain, const std::function<void(size_t begin, size_t end)>& func);
+
+	size_t ThreadCount() const { return _workers.size() + 1; };
+	static size_t DefaultThreadCount();
+
+private:
+	struct Task
+	{
+		std::function<void()> func;
+		TaskGroup* group;
+	};
+
+	struct TaskQueue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	void workerLoop(size_t queue);
+	size_t currentQueue() const;
+	bool takeTask(size_t queue, Task& task);
+	void run(Task& task);
+
+	vector<unique_ptr<TaskQueue>> _queues; // One per worker, the last one for outside threads
+	vector<std::thread> _workers;
+	std::atomic<size_t> _queuedTasks{ 0 };
+	std::mutex _sleepMutex;
+	std::condition_variable _wake;
+	bool _stopping = false;
+};